@@ -1,17 +1,19 @@
 #include <linux/string.h>
 #include <linux/in.h>
 #include <linux/uaccess.h>
+#include <linux/log2.h>
+#include <linux/mutex.h>
 #include "connp.h"
 #include "lkm_util.h"
 #include "hash.h"
 #include "cfg.h"
+#include "connpd.h"
 
 #define CFG_GLOBAL_FILE             "kconnp.conf"
 #define CFG_ALLOWED_IPORTS_FILE     "iports.allow"
 #define CFG_DENIED_IPORTS_FILE      "iports.deny"
 #define CFG_CONN_STATS_INFO_FILE    "stats.info"
 
-#define DUMP_INTERVAL 5 //seconds
 
 #define cfg_entries_walk_func_check(func_name)    \
     ({    \
@@ -183,6 +185,7 @@ static int ip_aton(const char *, struct in_addr *); //For IPV4
 static int iport_line_scan(struct cfg_entry *, 
         int *pos, int *line, 
         struct iport_pos_t *);
+static int iport_flags_parse(char *flags_str, struct iport_t *iport_node);
 static int iport_line_parse(struct iport_str_t *, 
         char *flags_str, char *port_str, char *ip_or_prefix, 
         int *ip_range_start, int *ip_range_end);
@@ -317,6 +320,10 @@ static struct cfg_entry white_list = { //final ACL list.
 };
 static struct cfg_entry *wl = &white_list;
 
+static struct cfg_prefilter_t cfg_prefilters[2];
+struct cfg_prefilter_t __rcu *cfg_prefilter;
+static DEFINE_MUTEX(cfg_prefilter_mutex); //one rebuild of the spare at a time
+
 static struct item_node_t cfg_global_items[] = {
     {
         .name = CONST_STRING("connection_wait_timeout"),
@@ -343,6 +350,21 @@ static struct item_node_t cfg_global_items[] = {
         .v_lval = 20,
         .cfg_item_set_node = cfg_item_set_int_node,
     },
+    {
+        .name = CONST_STRING("nonblock_connect_immediate"),
+        .v_lval = 0,
+        .cfg_item_set_node = cfg_item_set_int_node,
+    },
+    {
+        .name = CONST_STRING("max_connection_lifetime"),
+        .v_lval = 0,
+        .cfg_item_set_node = cfg_item_set_int_node,
+    },
+    {
+        .name = CONST_STRING("connection_lifetime_jitter"),
+        .v_lval = 10,
+        .cfg_item_set_node = cfg_item_set_int_node,
+    },
     {CONST_STRING_NULL, }
 };
 
@@ -452,6 +474,8 @@ static int cfg_proc_write(struct file *file, const char *buffer, unsigned long c
    
     ce->entity_reload(ce); //Reload proc cfg.
 
+    connpd_work_notify(CONNPD_WORK_PRECONNECT); //apply the new cfg.
+
     return count;
 }
 
@@ -527,6 +551,8 @@ static ssize_t cfg_proc_write(struct file *file, const char __user *buffer, size
 
     ce->entity_reload(ce); //Reload proc cfg.
 
+    connpd_work_notify(CONNPD_WORK_PRECONNECT); //apply the new cfg.
+
     return count;
 }
 
@@ -1201,6 +1227,152 @@ static int cfg_iports_data_scan(struct iports_str_list_t *iports_str_scanning_li
     return iports_str_scanning_list->count;
 }
 
+/**
+ *Parse the params of a flag: "n[-n]...", returns the count of the params, -1 on error.
+ */
+static int iport_flag_params_parse(const char *s, int len, unsigned int *params, int max)
+{
+    unsigned long v = 0;
+    int n = 0, digits = 0;
+    int i;
+
+    if (!len)
+        return 0;
+
+    for (i = 0; i <= len; i++) {
+
+        if (i == len || s[i] == '-') {
+            if (!digits || n >= max)
+                return -1;
+            params[n++] = v;
+            v = 0;
+            digits = 0;
+            continue;
+        }
+
+        if (s[i] < '0' || s[i] > '9')
+            return -1;
+
+        v = v * 10 + (s[i] - '0');
+        if (v > UINT_MAX)
+            return -1;
+
+        digits++;
+    }
+
+    return n;
+}
+
+static int iport_flag_set(struct iport_t *iport_node, char flag, unsigned int *params, int nparams)
+{
+    switch (flag) {
+        case 'S':
+            if (nparams)
+                return 0;
+            iport_node->flags |= CONN_STATEFUL;
+            break;
+        case 'I':
+            if (nparams)
+                return 0;
+            iport_node->flags |= CONN_IMMEDIATE;
+            break;
+        case 'W':
+            if (nparams)
+                return 0;
+            iport_node->flags |= CONN_KEEP_CWND;
+            break;
+        case 'F':
+            if (nparams)
+                return 0;
+            iport_node->flags |= CONN_FINGERPRINT;
+            break;
+        case 'L':
+            if (nparams != 1 || !params[0])
+                return 0;
+            iport_node->params.max_lifetime = params[0];
+            break;
+        case 'K':
+            if (nparams != 3 
+                    || !params[0] || params[0] > MAX_TCP_KEEPIDLE
+                    || !params[1] || params[1] > MAX_TCP_KEEPINTVL
+                    || !params[2] || params[2] > MAX_TCP_KEEPCNT)
+                return 0;
+            iport_node->params.keepalive_idle = params[0];
+            iport_node->params.keepalive_intvl = params[1];
+            iport_node->params.keepalive_cnt = params[2];
+            break;
+        case 'Q':
+            if (nparams != 1 || !params[0])
+                return 0;
+            iport_node->params.queue_timeout = params[0];
+            break;
+        case 'C':
+            if (nparams != 1 || !params[0])
+                return 0;
+            iport_node->params.active_ceiling = params[0];
+            break;
+        case 'E':
+            if (nparams != 1 || !params[0] || params[0] >= MAX_ERRNO)
+                return 0;
+            iport_node->params.active_errno = params[0];
+            break;
+        case 'B':
+            if (nparams != 2 || !params[0] || !params[1])
+                return 0;
+            iport_node->params.breaker_failures = params[0];
+            iport_node->params.breaker_open = params[1];
+            break;
+        case 'G':
+            if (nparams != 3 
+                    || !params[0] || params[0] > CONN_GROUPS_MAX
+                    || params[1] > params[2])
+                return 0;
+            iport_node->params.group = params[0];
+            iport_node->params.group_min_spare = params[1];
+            iport_node->params.group_max_spare = params[2];
+            break;
+        default: //N and the unknown flags without params.
+            if (nparams)
+                return 0;
+            break;
+    }
+
+    return 1;
+}
+
+/**
+ *Parse the flags str without blank: A|B|C300|D1-2-3...
+ *
+ *Returns:
+ *0: flags parse error, 1: flags parse success.
+ */
+static int iport_flags_parse(char *flags_str, struct iport_t *iport_node)
+{
+    unsigned int params[CONN_FLAG_PARAMS_MAX];
+    int nparams;
+    char *c, *end;
+
+    for (c = flags_str;; c = end + 1) {
+
+        if (*c < 'A' || *c > 'Z')
+            return 0;
+
+        for (end = c + 1; *end && *end != '|'; end++);
+
+        nparams = iport_flag_params_parse(c + 1, end - c - 1, params, CONN_FLAG_PARAMS_MAX);
+        if (nparams < 0)
+            return 0;
+
+        if (!iport_flag_set(iport_node, *c, params, nparams))
+            return 0;
+
+        if (!*end)
+            break;
+    }
+
+    return 1;
+}
+
 /**
  *Simple iport line parser.
  *
@@ -1227,28 +1399,22 @@ static int iport_line_parse(struct iport_str_t *iport_str,
     if (!flags_strlen)
         goto parse_going;
    
-    c = iport_str->flags_str; 
-    for (; c && *c; c++) {
-        
-        if (*c == ' ' || *c == '\t') //strip blank char
-            continue;
-    
-        if (*c != '|' && (*c < 'A' || *c > 'Z')) //valid flags: A|B|C|D...
-            return 0;
-        
-        if (*c == '|')
-            flags_sum -= 1;
-        else 
-            flags_sum += 1;
-    
-        if (flags_sum < 0)
-            return 0;
+    for (c = iport_str->flags_str; *c; c++) { //strip blank char
+        if (*c != ' ' && *c != '\t')
+            flags_str[flags_sum++] = *c;
     }
+    flags_str[flags_sum] = '\0';
 
-    if (flags_sum <= 0)
+    if (!flags_sum)
         return 0;
-    
-    strcpy(flags_str, iport_str->flags_str);
+
+    {
+        struct iport_t iport_node;
+
+        memset(&iport_node, 0, sizeof(struct iport_t));
+        if (!iport_flags_parse(flags_str, &iport_node)) //valid flags: A|B|C300|D1-2-3...
+            return 0;
+    }
 
 parse_going:
     /*Parse port str*/
@@ -1516,7 +1682,6 @@ static int cfg_iports_entity_init(struct cfg_entry *ce)
     p = iports_str_parsing_list->list;
     for (; p; p = p->next) {
         struct in_addr iaddr;
-        char *flag;
         
         memset(&iport_node, 0, sizeof(struct iport_t)); 
 
@@ -1539,17 +1704,8 @@ static int cfg_iports_entity_init(struct cfg_entry *ce)
         iport_node.port = htons(simple_strtol(p->port_str, NULL, 10));
 
         //flags init
-        for (flag = p->flags_str; flag && *flag; flag++) {
-
-            switch(*flag) {
-                case 'S':
-                    iport_node.flags |= CONN_STATEFUL;
-                    break;
-                default:
-                    break;
-            }
-
-        }
+        if (p->flags_str && *p->flags_str)
+            iport_flags_parse(p->flags_str, &iport_node);
 
         if (!hash_set((struct hash_table_t *)ce->cfg_ptr, 
                     (const char *)&iport_node, sizeof(struct iport_t), 
@@ -1653,13 +1809,53 @@ static void cfg_white_list_destroy(struct cfg_entry *ce)
     ce->entity_destroy(ce);
 }
 
+static inline void cfg_prefilter_add(struct cfg_prefilter_t *pf, 
+        unsigned int ip, unsigned short int port)
+{
+    unsigned int p = ntohs(port);
+
+    set_bit(p, pf->ports);
+
+    if (ip == 0) { //Wildcard
+        set_bit(p, pf->wildcard_ports);
+        return;
+    }
+
+    set_bit(CFG_PREFILTER_IP_HASH1(ip), pf->ips);
+    set_bit(CFG_PREFILTER_IP_HASH2(ip), pf->ips);
+}
+
+static void cfg_white_list_hot_free(struct cfg_entry *ce)
+{
+    struct conn_node_t *conn_node; 
+    struct hash_bucket_t *pos;
+
+    hash_for_each(ce->cfg_ptr, pos) {
+
+        conn_node = (struct conn_node_t *)hash_value(pos);
+        if (conn_node->conn_hot) {
+            lkmfree(conn_node->conn_hot);
+            conn_node->conn_hot = NULL;
+        }
+
+    }
+}
+
 static int cfg_white_list_entity_init(struct cfg_entry *ce)
 {
     struct iport_t *iport_node; 
     struct hash_bucket_t *pos;
+    struct cfg_prefilter_t *pf;
 
-    if (!cfg->al_ptr)
+    //Build the prefilter in the spare one, a failed build keeps the current one.
+    pf = (rcu_access_pointer(cfg_prefilter) == &cfg_prefilters[0]) 
+        ? &cfg_prefilters[1] : &cfg_prefilters[0];
+    memset(pf, 0, sizeof(struct cfg_prefilter_t));
+
+    if (!cfg->al_ptr) { //nothing allowed.
+        rcu_assign_pointer(cfg_prefilter, pf);
         return 0;
+    }
     
     if (!hash_init((struct hash_table_t **)&wl->cfg_ptr, NULL))
         return 0;
@@ -1689,6 +1885,16 @@ static int cfg_white_list_entity_init(struct cfg_entry *ce)
         conn_node.conn_ip = iport_node->ip;
         conn_node.conn_port = iport_node->port;
         conn_node.conn_flags = iport_node->flags;
+        conn_node.conn_params = iport_node->params;
+
+        //Count the destinations to preconnect the hot ones, no sketch no preconnect.
+        if (conn_node.conn_ip == 0 || conn_node.conn_port == 0) {
+            conn_node.conn_hot = lkmalloc(sizeof(struct conn_hot_t));
+            if (conn_node.conn_hot) {
+                spin_lock_init(&conn_node.conn_hot->lock);
+                conn_node.conn_hot->decay_jiffies = jiffies;
+            }
+        }
         
         //We regard stateful connection as passive socket to use it only once.
         if (conn_node.conn_flags & CONN_STATEFUL) {
@@ -1699,35 +1905,70 @@ static int cfg_white_list_entity_init(struct cfg_entry *ce)
         if (!hash_set((struct hash_table_t *)wl->cfg_ptr, 
                     (const char *)iport_node, sizeof(struct iport_raw_t), 
                     &conn_node, sizeof(struct conn_node_t))) {
+            if (conn_node.conn_hot)
+                lkmfree(conn_node.conn_hot);
+            cfg_white_list_hot_free(wl);
             hash_destroy((struct hash_table_t **)&wl->cfg_ptr);
             read_unlock(&cfg->al_rwlock);
             return 0;
         }
 
+        cfg_prefilter_add(pf, conn_node.conn_ip, conn_node.conn_port);
+
     }
 
     read_unlock(&cfg->al_rwlock);
 
+    rcu_assign_pointer(cfg_prefilter, pf);
+
     return 1;
 }
 
 static void cfg_white_list_entity_destroy(struct cfg_entry *ce)
 {
-    if (ce->cfg_ptr)
+    if (ce->cfg_ptr) {
+        cfg_white_list_hot_free(ce);
         hash_destroy((struct hash_table_t **)&ce->cfg_ptr);
+    }
 }
 
+/**
+ *The previous white list and prefilter are kept if the rebuild fails.
+ */
 static int cfg_white_list_entity_reload(struct cfg_entry *ce)
 {
+    void *old_cfg_ptr;
     int ret;
 
+    mutex_lock(&cfg_prefilter_mutex);
+
+    //The spare prefilter was current before the last swap, wait for its readers.
+    synchronize_rcu();
+
     write_lock(&ce->cfg_rwlock);
 
-    ce->entity_destroy(ce);
+    old_cfg_ptr = ce->cfg_ptr;
+    ce->cfg_ptr = NULL;
+
     ret = ce->entity_init(ce); 
 
+    if (!ret && cfg->al_ptr) { //failed, not the empty allowed list.
+        ce->cfg_ptr = old_cfg_ptr;
+        old_cfg_ptr = NULL;
+    }
+
+    if (old_cfg_ptr) {
+        void *new_cfg_ptr = ce->cfg_ptr;
+
+        ce->cfg_ptr = old_cfg_ptr;
+        ce->entity_destroy(ce);
+        ce->cfg_ptr = new_cfg_ptr;
+    }
+
     write_unlock(&ce->cfg_rwlock);
 
+    mutex_unlock(&cfg_prefilter_mutex);
+
     return ret;
 }
 
@@ -1764,6 +2005,549 @@ void cfg_destroy()
     lkm_proc_rmdir(CFG_BASE_DIR_NAME);
 }
  
+static inline int conn_idle_hist_idx(u32 ms)
+{
+    int octave, idx;
+
+    if (ms < (1U << CONN_IDLE_HIST_SUB_SHIFT))
+        return ms;
+
+    octave = ilog2(ms);
+    idx = ((octave - CONN_IDLE_HIST_SUB_SHIFT + 1) << CONN_IDLE_HIST_SUB_SHIFT)
+        + ((ms >> (octave - CONN_IDLE_HIST_SUB_SHIFT)) & ((1U << CONN_IDLE_HIST_SUB_SHIFT) - 1));
+
+    return MIN(idx, CONN_IDLE_HIST_BUCKETS - 1);
+}
+
+/**
+ *The lower bound (ms) of the bucket, the estimate is on the safe side.
+ */
+static inline u32 conn_idle_hist_lower(int idx)
+{
+    int octave, sub;
+
+    if (idx < (1 << CONN_IDLE_HIST_SUB_SHIFT))
+        return idx;
+
+    octave = (idx >> CONN_IDLE_HIST_SUB_SHIFT) - 1 + CONN_IDLE_HIST_SUB_SHIFT;
+    sub = idx & ((1 << CONN_IDLE_HIST_SUB_SHIFT) - 1);
+
+    return ((1U << CONN_IDLE_HIST_SUB_SHIFT) + sub) << (octave - CONN_IDLE_HIST_SUB_SHIFT);
+}
+
+/**
+ *Add the idle age of a sock closed by the server and predict the server idle timeout
+ *by a low percentile of the decayed histogram. Only kconnpd adds the samples.
+ */
+static void conn_idle_hist_add(struct conn_node_t *conn_node, u64 idle_jiffies)
+{
+    typeof(conn_node->conn_idle_hist) *hist = &conn_node->conn_idle_hist;
+    unsigned int target, cum = 0;
+    u64 timeout, margin;
+    int idx;
+
+    hist->buckets[conn_idle_hist_idx(jiffies_to_msecs(MIN(idle_jiffies, (u64)MAX_JIFFY_OFFSET)))]++;
+
+    if (++hist->samples >= CONN_IDLE_DECAY_SAMPLES) {
+        hist->samples = 0;
+        for (idx = 0; idx < CONN_IDLE_HIST_BUCKETS; idx++) {
+            hist->buckets[idx] >>= 1;
+            hist->samples += hist->buckets[idx];
+        }
+    }
+
+    if (hist->samples < CONN_IDLE_MIN_SAMPLES) {
+        hist->timeout = 0;
+        conn_node->conn_keep_alive = ULLONG_MAX;
+        return;
+    }
+
+    target = (hist->samples * CONN_IDLE_PERCENTILE + 99) / 100;
+    for (idx = 0; idx < CONN_IDLE_HIST_BUCKETS - 1; idx++) {
+        cum += hist->buckets[idx];
+        if (cum >= target)
+            break;
+    }
+
+    timeout = msecs_to_jiffies(conn_idle_hist_lower(idx));
+
+    margin = MIN(timeout >> 2, (u64)CONN_IDLE_MARGIN_MAX);
+    if (hist->samples < CONN_IDLE_CONFIDENT_SAMPLES)
+        margin <<= 1;
+
+    hist->timeout = timeout;
+    conn_node->conn_keep_alive = timeout > margin ? timeout - margin : 0;
+}
+
+static void conn_close_window_sum(struct conn_node_t *conn_node, unsigned int *counts)
+{
+    typeof(conn_node->conn_close_window) *window = &conn_node->conn_close_window;
+    unsigned long epoch = jiffies / CONN_CLOSE_WINDOW_SLOT_JIFFIES;
+    int i, kind;
+
+    for (kind = 0; kind < CONN_CLOSE_KINDS; kind++)
+        counts[kind] = 0;
+
+    for (i = 0; i < CONN_CLOSE_WINDOW_SLOTS; i++) {
+        if (epoch - window->slots[i].epoch >= CONN_CLOSE_WINDOW_SLOTS)
+            continue;
+
+        for (kind = 0; kind < CONN_CLOSE_KINDS; kind++)
+            counts[kind] += lkm_atomic_read(&window->slots[i].count[kind]);
+    }
+}
+
+/**
+ *Count the close in the sliding window and switch the close way of the iport
+ *only on the strong evidence, the counts of the decision are kept.
+ */
+static void conn_close_observe(struct conn_node_t *conn_node, conn_close_kind_t kind)
+{
+    typeof(conn_node->conn_close_window) *window = &conn_node->conn_close_window;
+    unsigned long epoch = jiffies / CONN_CLOSE_WINDOW_SLOT_JIFFIES;
+    unsigned int counts[CONN_CLOSE_KINDS];
+    unsigned int server, all;
+    int i;
+
+    if (kind < 0 || kind >= CONN_CLOSE_KINDS)
+        return;
+
+    i = epoch % CONN_CLOSE_WINDOW_SLOTS;
+    if (window->slots[i].epoch != epoch) { //the slot is out of the window, may lose a few counts on the race.
+        window->slots[i].epoch = epoch;
+        lkm_atomic_set(&window->slots[i].count[CONN_CLOSE_CLEAN], 0);
+        lkm_atomic_set(&window->slots[i].count[CONN_CLOSE_SERVER], 0);
+    }
+    lkm_atomic_add(&window->slots[i].count[kind], 1);
+
+    //Passive permanently
+    if (conn_node->conn_close_way_last_set_jiffies == ULLONG_MAX)
+        return;
+
+    conn_close_window_sum(conn_node, counts);
+    server = counts[CONN_CLOSE_SERVER];
+    all = server + counts[CONN_CLOSE_CLEAN];
+
+    if (conn_node->conn_close_way == CLOSE_POSITIVE) {
+        if (server < CONN_PASSIVE_MIN_SAMPLES 
+                || server * 100 < all * CONN_PASSIVE_DEMOTE_PERCENT)
+            return;
+
+        conn_node->conn_close_way = CLOSE_PASSIVE;
+        window->demotions++;
+    } else {
+        if (all < CONN_PASSIVE_MIN_SAMPLES 
+                || server * 100 > all * CONN_PASSIVE_PROMOTE_PERCENT)
+            return;
+
+        conn_node->conn_close_way = CLOSE_POSITIVE;
+        window->promotions++;
+    }
+
+    conn_node->conn_close_way_last_set_jiffies = lkm_jiffies;
+    window->last_server = server;
+    window->last_all = all;
+}
+
+//Keep the learned options template untorn.
+static DEFINE_SPINLOCK(conn_sockopts_lock);
+
+#define CONN_HANDOUT_EWMA(avg, v) \
+    ((avg) ? (avg) - ((avg) >> CONN_HANDOUT_EWMA_SHIFT) + (v) : (v) << CONN_HANDOUT_EWMA_SHIFT)
+
+/**
+ *Average the cwnd and the srtt of the handout socks, racy updates only lose a sample.
+ */
+static inline void conn_handout_observe(struct conn_node_t *conn_node, 
+        struct conn_handout_sample_t *sample)
+{
+    conn_node->conn_handout_cwnd = CONN_HANDOUT_EWMA(conn_node->conn_handout_cwnd, sample->cwnd);
+    conn_node->conn_handout_srtt_us = CONN_HANDOUT_EWMA(conn_node->conn_handout_srtt_us, sample->srtt_us);
+
+    if (sample->cwnd_kept)
+        lkm_atomic_add(&conn_node->conn_handout_cwnd_kept, 1);
+}
+
+/**
+ *The counts of the rejected socks indexed by the reason, of a handout.
+ */
+static inline void conn_handout_rejects_add(struct conn_node_t *conn_node, int *rejects)
+{
+    int reason;
+
+    for (reason = HANDOUT_VALID + 1; reason < HANDOUT_REJECT_REASONS; reason++) {
+        if (rejects[reason] > 0)
+            lkm_atomic_add(&conn_node->conn_handout_reject_count[reason], rejects[reason]);
+    }
+}
+
+/**
+ *Count the conn in, the conn over the ceiling is not counted.
+ *
+ *Returns:
+ *1: counted, 0: over the ceiling with the errno to fail.
+ */
+static inline int conn_active_acquire(struct conn_node_t *conn_node, int *err)
+{
+    unsigned int ceiling = conn_node->conn_params.active_ceiling;
+    long active = lkm_atomic_add(&conn_node->conn_active_count, 1);
+
+    if (!ceiling || active <= (long)ceiling)
+        return 1;
+
+    lkm_atomic_sub(&conn_node->conn_active_count, 1);
+    lkm_atomic_add(&conn_node->conn_active_throttled, 1);
+
+    *err = conn_node->conn_params.active_errno ? conn_node->conn_params.active_errno : EAGAIN;
+
+    return 0;
+}
+
+static inline void conn_active_add(struct conn_node_t *conn_node, long delta)
+{
+    //The count is restarted by the cfg reload, the conns before it are not dropped below 0.
+    if (lkm_atomic_add(&conn_node->conn_active_count, delta) < 0)
+        lkm_atomic_sub(&conn_node->conn_active_count, delta);
+}
+
+#define CONN_BREAKER_FAST_ERRNO(conn_node) \
+    ((conn_node)->conn_params.active_errno ? (conn_node)->conn_params.active_errno : CONN_BREAKER_ERRNO)
+
+#define CONN_BREAKER_OPEN_ELAPSED(conn_node) \
+    time_after_eq(jiffies, (conn_node)->conn_breaker.since + (conn_node)->conn_params.breaker_open * HZ)
+
+//One breaker would fail all the hosts of the wildcard entry, so it is never armed.
+#define CONN_BREAKER_ARMED(conn_node) \
+    ((conn_node)->conn_params.breaker_failures && (conn_node)->conn_ip && (conn_node)->conn_port)
+
+static inline int conn_breaker_transit(struct conn_node_t *conn_node, int from, int to)
+{
+    if (cmpxchg(&conn_node->conn_breaker.state, from, to) != from)
+        return 0;
+
+    conn_node->conn_breaker.since = jiffies;
+
+    if (to == CONN_BREAKER_OPEN) {
+        conn_node->conn_breaker.trips++;
+        lkm_atomic_set(&conn_node->conn_breaker.failures, 0);
+    }
+
+    return 1;
+}
+
+static void conn_breaker_observe(struct conn_node_t *conn_node, conn_breaker_event_t event)
+{
+    if (!CONN_BREAKER_ARMED(conn_node))
+        return;
+
+    if (event == CONN_BREAKER_SUCCESS) {
+        lkm_atomic_set(&conn_node->conn_breaker.failures, 0);
+        conn_breaker_transit(conn_node, CONN_BREAKER_HALF_OPEN, CONN_BREAKER_CLOSED);
+        return;
+    }
+
+    //The probe failed, open again.
+    if (conn_breaker_transit(conn_node, CONN_BREAKER_HALF_OPEN, CONN_BREAKER_OPEN))
+        return;
+
+    if (lkm_atomic_add(&conn_node->conn_breaker.failures, 1) 
+            >= (long)conn_node->conn_params.breaker_failures)
+        conn_breaker_transit(conn_node, CONN_BREAKER_CLOSED, CONN_BREAKER_OPEN);
+}
+
+/**
+ *The probe lost for the seconds, e.g. the preconnect never ran or its result never came,
+ *closes the breaker. The failures in a row open it again if the server is still broken.
+ */
+static inline int conn_breaker_half_open_expire(struct conn_node_t *conn_node)
+{
+    return conn_node->conn_breaker.state == CONN_BREAKER_HALF_OPEN 
+        && CONN_BREAKER_OPEN_ELAPSED(conn_node)
+        && conn_breaker_transit(conn_node, CONN_BREAKER_HALF_OPEN, CONN_BREAKER_CLOSED);
+}
+
+/**
+ *Returns:
+ *1: the connect passes, 0: fails at once with the errno.
+ */
+static inline int conn_breaker_allow(struct conn_node_t *conn_node, int *err)
+{
+    if (!CONN_BREAKER_ARMED(conn_node) 
+            || conn_node->conn_breaker.state == CONN_BREAKER_CLOSED)
+        return 1;
+
+    if (conn_breaker_half_open_expire(conn_node))
+        return 1;
+
+    if (conn_node->conn_breaker.state == CONN_BREAKER_OPEN && CONN_BREAKER_OPEN_ELAPSED(conn_node))
+        connpd_work_notify(CONNPD_WORK_PRECONNECT);
+
+    lkm_atomic_add(&conn_node->conn_breaker.fast_fails, 1);
+
+    *err = CONN_BREAKER_FAST_ERRNO(conn_node);
+
+    return 0;
+}
+
+int cfg_conn_breaker_preconnect(struct conn_node_t *conn_node, int nums)
+{
+    if (!CONN_BREAKER_ARMED(conn_node))
+        return nums;
+
+    switch (conn_node->conn_breaker.state) {
+        case CONN_BREAKER_OPEN:
+            if (CONN_BREAKER_OPEN_ELAPSED(conn_node)
+                    && conn_breaker_transit(conn_node, CONN_BREAKER_OPEN, CONN_BREAKER_HALF_OPEN))
+                return 1;
+            return 0;
+        case CONN_BREAKER_HALF_OPEN:
+            return conn_breaker_half_open_expire(conn_node) ? nums : 0;
+        default:
+            return nums;
+    }
+}
+
+static inline void conn_queue_observe(struct conn_node_t *conn_node, 
+        struct conn_queue_sample_t *sample)
+{
+    if (sample->event == CONN_QUEUE_ENTER) {
+        lkm_atomic_add(&conn_node->conn_queue_depth, 1);
+        return;
+    }
+
+    lkm_atomic_sub(&conn_node->conn_queue_depth, 1);
+
+    if (sample->event == CONN_QUEUE_SERVED)
+        lkm_atomic_add(&conn_node->conn_queue_served, 1);
+    else
+        lkm_atomic_add(&conn_node->conn_queue_timeouts, 1);
+
+    conn_node->conn_queue_wait_us = CONN_HANDOUT_EWMA(conn_node->conn_queue_wait_us, sample->wait_us);
+}
+
+#define CONN_HOT_GUARANTEED(slot) ((slot)->count - (slot)->error)
+
+/**
+ *Space-saving: a new destination replaces the least counted one and inherits
+ *its count as the error, the top destinations are kept with the bounded slots.
+ */
+static void conn_hot_observe(struct conn_node_t *conn_node, 
+        unsigned int ip, unsigned short int port, int hit)
+{
+    struct conn_hot_slot_t *slot, *min = NULL;
+    int i;
+
+    if (!conn_node->conn_hot)
+        return;
+
+    spin_lock(&conn_node->conn_hot->lock);
+
+    for (i = 0; i < CONN_HOT_SLOTS; i++) {
+
+        slot = &conn_node->conn_hot->slots[i];
+
+        if (slot->ip == ip && slot->port == port)
+            goto count;
+
+        if (!min || slot->count < min->count)
+            min = slot;
+    }
+
+    slot = min;
+    memset(slot->stats, 0, sizeof(slot->stats));
+    slot->ip = ip;
+    slot->port = port;
+    slot->error = slot->count;
+    slot->pooled = 0;
+    slot->idle = 0;
+    slot->hot = 0;
+    slot->preconnect_nums = 0;
+
+count:
+    slot->count++;
+    slot->stats[hit ? CONN_HOT_HITS : CONN_HOT_MISSES]++;
+
+    spin_unlock(&conn_node->conn_hot->lock);
+}
+
+/**
+ *Whether the destination is one of the top ones preconnected by the wildcard entry.
+ */
+static int conn_hot_check(struct conn_node_t *conn_node, 
+        unsigned int ip, unsigned short int port)
+{
+    struct conn_hot_slot_t *slot;
+    int i, ret = 0;
+
+    if (!conn_node->conn_hot)
+        return 0;
+
+    spin_lock(&conn_node->conn_hot->lock);
+
+    for (i = 0; i < CONN_HOT_SLOTS; i++) {
+        slot = &conn_node->conn_hot->slots[i];
+        if (slot->ip == ip && slot->port == port) {
+            ret = slot->hot;
+            break;
+        }
+    }
+
+    spin_unlock(&conn_node->conn_hot->lock);
+
+    return ret;
+}
+
+static void conn_hot_stat_inc(struct conn_node_t *conn_node, 
+        unsigned int ip, unsigned short int port, conn_hot_stat_t stat)
+{
+    struct conn_hot_slot_t *slot;
+    int i;
+
+    if (!conn_node->conn_hot)
+        return;
+
+    spin_lock(&conn_node->conn_hot->lock);
+
+    for (i = 0; i < CONN_HOT_SLOTS; i++) {
+        slot = &conn_node->conn_hot->slots[i];
+        if (slot->ip == ip && slot->port == port) {
+            slot->stats[stat]++;
+            break;
+        }
+    }
+
+    spin_unlock(&conn_node->conn_hot->lock);
+}
+
+int cfg_conn_hot_preconnect(struct conn_node_t *conn_node, int min_spare)
+{
+    struct conn_hot_t *hot = conn_node->conn_hot;
+    struct conn_hot_slot_t *slot, *top;
+    int pending = 0;
+    int i, n;
+
+    if (!hot)
+        return 0;
+
+    spin_lock(&conn_node->conn_hot->lock);
+
+    for (i = 0; i < CONN_HOT_SLOTS; i++)
+        hot->slots[i].hot = 0;
+
+    //Promote the top ones, the pooled socks of the demoted ones are closed by the next scan.
+    for (n = 0; n < CONN_HOT_TOP; n++) {
+
+        top = NULL;
+
+        for (i = 0; i < CONN_HOT_SLOTS; i++) {
+            slot = &hot->slots[i];
+            if (slot->hot || !slot->count)
+                continue;
+            if (!top || CONN_HOT_GUARANTEED(slot) > CONN_HOT_GUARANTEED(top))
+                top = slot;
+        }
+
+        if (!top || CONN_HOT_GUARANTEED(top) < CONN_HOT_MIN_CONNECTS)
+            break;
+
+        top->hot = 1;
+    }
+
+    for (i = 0; i < CONN_HOT_SLOTS; i++) {
+
+        slot = &hot->slots[i];
+
+        slot->pooled = slot->stats[CONN_HOT_POOLED];
+        slot->idle = slot->stats[CONN_HOT_IDLE];
+        slot->stats[CONN_HOT_POOLED] = 0;
+        slot->stats[CONN_HOT_IDLE] = 0;
+
+        if (slot->hot && (int)slot->idle < min_spare)
+            slot->preconnect_nums = min_spare - slot->idle;
+        else
+            slot->preconnect_nums = 0;
+
+        pending += slot->preconnect_nums;
+    }
+
+    if (time_after_eq(jiffies, hot->decay_jiffies + CONN_HOT_DECAY_INTERVAL)) {
+        for (i = 0; i < CONN_HOT_SLOTS; i++) {
+            hot->slots[i].count >>= 1;
+            hot->slots[i].error >>= 1;
+        }
+        hot->decay_jiffies = jiffies;
+    }
+
+    spin_unlock(&conn_node->conn_hot->lock);
+
+    return pending;
+}
+
+int cfg_conn_hot_preconnect_take(struct conn_node_t *conn_node, 
+        struct sockaddr_in *addrs, int *nums)
+{
+    struct conn_hot_slot_t *slot;
+    int i, n = 0;
+
+    if (!conn_node->conn_hot)
+        return 0;
+
+    spin_lock(&conn_node->conn_hot->lock);
+
+    for (i = 0; i < CONN_HOT_SLOTS; i++) {
+
+        slot = &conn_node->conn_hot->slots[i];
+        if (slot->preconnect_nums <= 0)
+            continue;
+
+        addrs[n].sin_family = AF_INET;
+        addrs[n].sin_addr.s_addr = slot->ip;
+        addrs[n].sin_port = slot->port;
+        nums[n++] = slot->preconnect_nums;
+
+        slot->preconnect_nums = 0;
+    }
+
+    spin_unlock(&conn_node->conn_hot->lock);
+
+    return n;
+}
+
+/**
+ *The other members of the group, the wildcard entries are never the members.
+ *Under the read lock of the white list.
+ */
+static int conn_group_members(struct conn_node_t *conn_node, 
+        struct conn_group_members_t *members)
+{
+    struct conn_node_t *member;
+    struct hash_bucket_t *pos;
+
+    members->nums = 0;
+
+    if (!conn_node->conn_params.group)
+        return 0;
+
+    hash_for_each(wl->cfg_ptr, pos) {
+
+        member = (struct conn_node_t *)hash_value(pos);
+
+        if (member == conn_node 
+                || member->conn_params.group != conn_node->conn_params.group
+                || member->conn_ip == 0 || member->conn_port == 0)
+            continue;
+
+        members->addrs[members->nums].sin_family = AF_INET;
+        members->addrs[members->nums].sin_addr.s_addr = member->conn_ip;
+        members->addrs[members->nums].sin_port = member->conn_port;
+
+        if (++members->nums >= CONN_GROUP_MEMBERS_MAX)
+            break;
+    }
+
+    return members->nums > 0;
+}
+
 int cfg_conn_op(struct sockaddr *addr, int op_type, void *val)
 {
     struct conn_node_t *conn_node;
@@ -1805,26 +2589,114 @@ int cfg_conn_op(struct sockaddr *addr, int op_type, void *val)
             if (lkm_jiffies_elapsed_from(conn_node->conn_close_way_last_set_jiffies)
                     > CONN_PASSIVE_TIMEOUT_JIFFIES_THRESHOLD) {
                conn_node->conn_close_way = CLOSE_POSITIVE;
-               conn_node->conn_keep_alive = ULLONG_MAX; //reset pemanently.
                conn_node->conn_close_way_last_set_jiffies = lkm_jiffies;
                ret = 1;
             }
             break;
 
-        case PASSIVE_SET:
-            conn_node->conn_close_way = CLOSE_PASSIVE;
-            if (conn_node->conn_close_way_last_set_jiffies != ULLONG_MAX)
-                conn_node->conn_close_way_last_set_jiffies = lkm_jiffies;
+        case CLOSE_OBSERVE:
+            conn_close_observe(conn_node, (conn_close_kind_t)(unsigned long)val);
+            if ((conn_close_kind_t)(unsigned long)val == CONN_CLOSE_CLEAN) //a healthy conn.
+                conn_breaker_observe(conn_node, CONN_BREAKER_SUCCESS);
+            else
+                conn_hot_stat_inc(conn_node, ip, port, CONN_HOT_PASSIVES);
             break;
 
-        case KEEP_ALIVE_SET:
-            conn_node->conn_keep_alive = *((typeof(conn_node->conn_keep_alive)*)val);
+        case IDLE_CLOSE_ADD:
+            conn_idle_hist_add(conn_node, *((u64 *)val));
             break;
 
         case KEEP_ALIVE_GET:
             *((typeof(conn_node->conn_keep_alive)*)val) = conn_node->conn_keep_alive;
             break;
 
+        case FLAG_CHECK:
+            ret = (conn_node->conn_flags & (int)(unsigned long)val) ? 1 : 0;
+            break;
+
+        case MAX_LIFETIME_GET:
+            *((u64 *)val) = (u64)(conn_node->conn_params.max_lifetime 
+                    ? conn_node->conn_params.max_lifetime : GN("max_connection_lifetime")) * HZ;
+            break;
+
+        case KEEPALIVE_GET:
+            {
+                struct lkm_keepalive_t *ka = (struct lkm_keepalive_t *)val;
+
+                memset(ka, 0, sizeof(*ka));
+                if (!(ret = (conn_node->conn_params.keepalive_idle != 0)))
+                    break;
+
+                ka->on = 1;
+                ka->probes = conn_node->conn_params.keepalive_cnt;
+                ka->time = conn_node->conn_params.keepalive_idle * HZ;
+                ka->intvl = conn_node->conn_params.keepalive_intvl * HZ;
+            }
+            break;
+
+        case HANDOUT_OBSERVE:
+            conn_handout_observe(conn_node, (struct conn_handout_sample_t *)val);
+            break;
+
+        case HANDOUT_REJECTS_ADD:
+            conn_handout_rejects_add(conn_node, (int *)val);
+            break;
+
+        case QUEUE_TIMEOUT_GET:
+            *((u64 *)val) = msecs_to_jiffies(conn_node->conn_params.queue_timeout);
+            break;
+
+        case QUEUE_OBSERVE:
+            conn_queue_observe(conn_node, (struct conn_queue_sample_t *)val);
+            break;
+
+        case ACTIVE_ACQUIRE:
+            ret = conn_active_acquire(conn_node, (int *)val);
+            break;
+
+        case ACTIVE_ADD:
+            conn_active_add(conn_node, (long)val);
+            break;
+
+        case BREAKER_OBSERVE:
+            conn_breaker_observe(conn_node, (conn_breaker_event_t)(unsigned long)val);
+            break;
+
+        case BREAKER_ALLOW:
+            ret = conn_breaker_allow(conn_node, (int *)val);
+            break;
+
+        case HOT_OBSERVE:
+            conn_hot_observe(conn_node, ip, port, (int)(unsigned long)val);
+            break;
+
+        case HOT_STAT_INC:
+            conn_hot_stat_inc(conn_node, ip, port, (conn_hot_stat_t)(unsigned long)val);
+            break;
+
+        case PRECONNECT_CHECK: //the spec iport, or the hot destination of the wildcard.
+            ret = (conn_node->conn_ip != 0 && conn_node->conn_port != 0)
+                || conn_hot_check(conn_node, ip, port);
+            break;
+
+        case GROUP_MEMBERS_GET:
+            ret = conn_group_members(conn_node, (struct conn_group_members_t *)val);
+            break;
+
+        case SOCKOPTS_LEARN:
+            spin_lock(&conn_sockopts_lock);
+            conn_node->conn_sockopts.opts = *((struct lkm_sockopts_t *)val);
+            conn_node->conn_sockopts.learned = 1;
+            spin_unlock(&conn_sockopts_lock);
+            break;
+
+        case SOCKOPTS_GET:
+            spin_lock(&conn_sockopts_lock);
+            if ((ret = conn_node->conn_sockopts.learned))
+                *((struct lkm_sockopts_t *)val) = conn_node->conn_sockopts.opts;
+            spin_unlock(&conn_sockopts_lock);
+            break;
+
         default:
             ret = 0;
             break;
@@ -1857,6 +2729,28 @@ unlock_ret:
     return;
 }
 
+void cfg_allowed_entries_for_each_call_arg(void (*call_func)(void *data, void *arg), void *arg)
+{
+    struct conn_node_t *conn_node; 
+    struct hash_bucket_t *pos;
+
+    read_lock(&wl->cfg_rwlock);
+
+    if (!wl->cfg_ptr)
+        goto unlock_ret;
+
+    hash_for_each(wl->cfg_ptr, pos) {
+
+        conn_node = (struct conn_node_t *)hash_value(pos);
+        call_func((void *)conn_node, arg);
+
+    }
+
+unlock_ret:
+    read_unlock(&wl->cfg_rwlock);
+    return;
+}
+
 void cfg_allowd_iport_node_for_each_call(unsigned int ip, unsigned short int port, 
         void (*call_func)(void *data)) 
 {
@@ -1865,20 +2759,84 @@ void cfg_allowd_iport_node_for_each_call(unsigned int ip, unsigned short int por
     read_unlock(&wl->cfg_rwlock);
 }
 
+static const char *conn_breaker_state_names[] = {
+    [CONN_BREAKER_CLOSED] = "CLOSED",
+    [CONN_BREAKER_OPEN] = "OPEN",
+    [CONN_BREAKER_HALF_OPEN] = "HALF-OPEN",
+};
+
+/**
+ *The destinations of the wildcard entry, a line each under the entry line.
+ */
+static int conn_hot_stats_sprint(struct conn_node_t *conn_node, char *buf, int size)
+{
+    struct conn_hot_slot_t slot;
+    int offset = 0;
+    int i, l;
+
+    if (!conn_node->conn_hot)
+        return 0;
+
+    for (i = 0; i < CONN_HOT_SLOTS; i++) {
+
+        spin_lock(&conn_node->conn_hot->lock);
+        slot = conn_node->conn_hot->slots[i];
+        spin_unlock(&conn_node->conn_hot->lock);
+
+        if (!slot.ip && !slot.port)
+            continue;
+
+        l = snprintf(buf + offset, size - offset,
+                "  %s:%u, Hot: %s, Connects: %u(+-%u), Hits: %u, Misses: %u, "
+                "Pooled: %u, Idle: %u, Evictions: %u, Passives: %u\n",
+                ip_ntoa(slot.ip), ntohs(slot.port), 
+                slot.hot ? "yes" : "no",
+                slot.count, slot.error,
+                slot.stats[CONN_HOT_HITS], slot.stats[CONN_HOT_MISSES],
+                slot.pooled, slot.idle,
+                slot.stats[CONN_HOT_EVICTIONS], slot.stats[CONN_HOT_PASSIVES]);
+        if (l >= size - offset)
+            break;
+
+        offset += l;
+    }
+
+    return offset;
+}
+
 void conn_stats_info_dump(void)
 {
     const char *conn_stat_str_fmt = 
 #if BITS_PER_LONG < 64
-        "%s:%u, Mode: %s, Hits: %d(%u.0%), Misses: %d(%u.0%)\n";
+        "%s:%u, Mode: %s, Hits: %d(%u.0%), Misses: %d(%u.0%), "
+        "Rejects: RecvQ %d, FIN %d, Err %d, SendQ %d, "
+        "Handout cwnd: %u, srtt: %u us, cwnd kept: %d, "
+        "Active: %d/%u, Throttled: %d, "
+        "Breaker: %s(trips %u, fast fails %d), "
+        "Queue: depth %d, served %d, timeouts %d, wait %u us, "
+        "Group: %u(hits %d), "
+        "Idle timeout: %u ms(%u samples), "
+        "Server closes: %u/%u, Demoted: %u, Promoted: %u, Last decision: %u/%u\n";
 #else
-        "%s:%u, Mode: %s, Hits: %ld(%u.0%), Misses: %ld(%u.0%)\n";
+        "%s:%u, Mode: %s, Hits: %ld(%u.0%), Misses: %ld(%u.0%), "
+        "Rejects: RecvQ %ld, FIN %ld, Err %ld, SendQ %ld, "
+        "Handout cwnd: %u, srtt: %u us, cwnd kept: %ld, "
+        "Active: %ld/%u, Throttled: %ld, "
+        "Breaker: %s(trips %u, fast fails %ld), "
+        "Queue: depth %ld, served %ld, timeouts %ld, wait %u us, "
+        "Group: %u(hits %ld), "
+        "Idle timeout: %u ms(%u samples), "
+        "Server closes: %u/%u, Demoted: %u, Promoted: %u, Last decision: %u/%u\n";
 #endif
     struct hash_bucket_t *pos;
     int offset = 0;
+    int limit; //of the iport lines, the rest is kept for the thread lines.
 
     if (NOW_SECS - wl->mtime < DUMP_INTERVAL)
         return;
 
+    limit = PAGE_SIZE - connpd_stats_info_reserve();
+
     write_lock(&cfg->st_rwlock);
 
     if (cfg->st_ptr) {
@@ -1901,9 +2859,9 @@ void conn_stats_info_dump(void)
         long all_count, misses_count, hits_count;
 #endif
         unsigned int misses_percent, hits_percent; 
+        unsigned int closes[CONN_CLOSE_KINDS];
         char *ip_ptr, ip_str[16] = {0, };
         char mode[16] = {0, };
-        char buffer[128] = {0, };
         int l;
         
         conn_node = (struct conn_node_t *)hash_value(pos);
@@ -1922,6 +2880,8 @@ void conn_stats_info_dump(void)
            
         port = ntohs(conn_node->conn_port);
        
+        conn_close_window_sum(conn_node, closes);
+
         hits_count = lkm_atomic_read(&conn_node->conn_connected_hit_count);
         misses_count = lkm_atomic_read(&conn_node->conn_connected_miss_count);
         all_count = hits_count + misses_count;
@@ -1934,24 +2894,55 @@ void conn_stats_info_dump(void)
             hits_percent = 100 - misses_percent;
         }
 
-        l = sprintf(buffer, conn_stat_str_fmt, 
+        //Straight into the page, a line not fitting in the rest is dropped with the ones after.
+        l = snprintf(cfg->st_ptr + offset, limit - cfg->st_len, conn_stat_str_fmt, 
                 ip_ptr, port, 
                 mode, 
                 hits_count, hits_percent,
-                misses_count, misses_percent);
-
-        if (l > (PAGE_SIZE - cfg->st_len)) {
-            goto unlock_ret;
-        }
-        
-        memcpy(cfg->st_ptr + offset, buffer, l); 
+                misses_count, misses_percent,
+                lkm_atomic_read(&conn_node->conn_handout_reject_count[HANDOUT_REJECT_RECV_QUEUE]),
+                lkm_atomic_read(&conn_node->conn_handout_reject_count[HANDOUT_REJECT_RCV_SHUTDOWN]),
+                lkm_atomic_read(&conn_node->conn_handout_reject_count[HANDOUT_REJECT_SK_ERR]),
+                lkm_atomic_read(&conn_node->conn_handout_reject_count[HANDOUT_REJECT_WRITE_QUEUE]),
+                conn_node->conn_handout_cwnd >> CONN_HANDOUT_EWMA_SHIFT,
+                conn_node->conn_handout_srtt_us >> CONN_HANDOUT_EWMA_SHIFT,
+                lkm_atomic_read(&conn_node->conn_handout_cwnd_kept),
+                lkm_atomic_read(&conn_node->conn_active_count),
+                conn_node->conn_params.active_ceiling,
+                lkm_atomic_read(&conn_node->conn_active_throttled),
+                conn_breaker_state_names[conn_node->conn_breaker.state],
+                conn_node->conn_breaker.trips,
+                lkm_atomic_read(&conn_node->conn_breaker.fast_fails),
+                lkm_atomic_read(&conn_node->conn_queue_depth),
+                lkm_atomic_read(&conn_node->conn_queue_served),
+                lkm_atomic_read(&conn_node->conn_queue_timeouts),
+                conn_node->conn_queue_wait_us >> CONN_HANDOUT_EWMA_SHIFT,
+                conn_node->conn_params.group,
+                lkm_atomic_read(&conn_node->conn_group_hit_count),
+                jiffies_to_msecs(conn_node->conn_idle_hist.timeout), 
+                conn_node->conn_idle_hist.samples,
+                closes[CONN_CLOSE_SERVER], closes[CONN_CLOSE_SERVER] + closes[CONN_CLOSE_CLEAN],
+                conn_node->conn_close_window.demotions,
+                conn_node->conn_close_window.promotions,
+                conn_node->conn_close_window.last_server, conn_node->conn_close_window.last_all);
+
+        if (l >= (limit - cfg->st_len))
+            break;
 
         offset += l; 
 
         cfg->st_len += l;
 
+        l = conn_hot_stats_sprint(conn_node, cfg->st_ptr + offset, limit - cfg->st_len);
+
+        offset += l;
+
+        cfg->st_len += l;
+
     }
 
+    cfg->st_len += connpd_stats_info_sprint(cfg->st_ptr + offset, PAGE_SIZE - cfg->st_len);
+
     wl->mtime = NOW_SECS;
 
 unlock_ret:
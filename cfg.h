@@ -3,12 +3,17 @@
 
 #include <linux/socket.h>
 #include <linux/proc_fs.h>
+#include <linux/hash.h>
+#include <linux/bitops.h>
+#include <linux/rcupdate.h>
 #include "connp.h"
 #include "hash.h"
 #include "kconnp.h"
 
 #define CFG_BASE_DIR_NAME "kconnp"
 
+#define DUMP_INTERVAL 5 //seconds of the stats dump
+
 struct cfg_entry {
     /*attributes*/
     char *f_name; /*cfg file name*/
@@ -120,6 +125,7 @@ struct iport_t {
     unsigned int ip;
     unsigned short int port;
     unsigned int flags;
+    struct conn_params_t params;
 };
 
 struct iport_raw_t {
@@ -134,14 +140,33 @@ struct conn_node_t {
 
     struct conn_attr_t conn_attrs;
 #define conn_flags conn_attrs.flags
+#define conn_params conn_attrs.params
 #define conn_close_way conn_attrs.close_way_attrs.close_way
 #define conn_close_way_last_set_jiffies conn_attrs.close_way_attrs.last_set_jiffies
+#define conn_close_window conn_attrs.close_window
 #define conn_keep_alive conn_attrs.keep_alive
+#define conn_idle_hist conn_attrs.idle_hist
+#define conn_sockopts conn_attrs.sockopts
+#define conn_breaker conn_attrs.breaker
+#define conn_hot conn_attrs.hot
 #define conn_close_now conn_attrs.close_now
+#define conn_preferred_node conn_attrs.preferred_node
+#define conn_preconnect_nums conn_attrs.preconnect_nums
 #define conn_all_count conn_attrs.stats.all_count
 #define conn_idle_count conn_attrs.stats.idle_count
 #define conn_connected_hit_count conn_attrs.stats.connected_hit_count
 #define conn_connected_miss_count conn_attrs.stats.connected_miss_count
+#define conn_handout_reject_count conn_attrs.stats.handout_reject_count
+#define conn_handout_cwnd conn_attrs.stats.handout_cwnd
+#define conn_handout_srtt_us conn_attrs.stats.handout_srtt_us
+#define conn_handout_cwnd_kept conn_attrs.stats.handout_cwnd_kept
+#define conn_active_count conn_attrs.stats.active_count
+#define conn_active_throttled conn_attrs.stats.active_throttled
+#define conn_queue_depth conn_attrs.stats.queue_depth
+#define conn_queue_served conn_attrs.stats.queue_served
+#define conn_queue_timeouts conn_attrs.stats.queue_timeouts
+#define conn_queue_wait_us conn_attrs.stats.queue_wait_us
+#define conn_group_hit_count conn_attrs.stats.group_hit_count
 };
 
 struct iport_str_t {
@@ -175,20 +200,119 @@ struct iport_pos_t {
 #define ACL_CHECK               0x0
 #define ACL_SPEC_CHECK          0x1
 #define POSITIVE_CHECK          0x2
-#define PASSIVE_SET             0x3
-#define KEEP_ALIVE_SET          0x4
+#define CLOSE_OBSERVE           0x3
+#define IDLE_CLOSE_ADD          0x4
 #define KEEP_ALIVE_GET          0x5
+#define FLAG_CHECK              0x6
+#define MAX_LIFETIME_GET        0x7
+#define KEEPALIVE_GET           0x8
+#define HANDOUT_OBSERVE         0x9
+#define SOCKOPTS_LEARN          0xa
+#define SOCKOPTS_GET            0xb
+#define QUEUE_TIMEOUT_GET       0xc
+#define QUEUE_OBSERVE           0xd
+#define ACTIVE_ACQUIRE          0xe
+#define ACTIVE_ADD              0xf
+#define BREAKER_OBSERVE         0x10
+#define BREAKER_ALLOW           0x11
+#define GROUP_MEMBERS_GET       0x12
+#define HOT_OBSERVE             0x13
+#define HOT_STAT_INC            0x14
+#define PRECONNECT_CHECK        0x15
+#define HANDOUT_REJECTS_ADD     0x16
 
 #define cfg_conn_acl_allowd(addr) cfg_conn_op(addr, ACL_CHECK, NULL)
 #define cfg_conn_acl_spec_allowd(addr) cfg_conn_op(addr, ACL_SPEC_CHECK, NULL)
 #define cfg_conn_is_positive(addr) cfg_conn_op(addr, POSITIVE_CHECK, NULL)
-#define cfg_conn_set_passive(addr) cfg_conn_op(addr, PASSIVE_SET, NULL)
-#define cfg_conn_set_keep_alive(addr, val) cfg_conn_op(addr, KEEP_ALIVE_SET, val)
+#define cfg_conn_observe_close(addr, kind) cfg_conn_op(addr, CLOSE_OBSERVE, (void *)(unsigned long)(kind))
+#define cfg_conn_add_idle_close(addr, val) cfg_conn_op(addr, IDLE_CLOSE_ADD, val)
 #define cfg_conn_get_keep_alive(addr, val) cfg_conn_op(addr, KEEP_ALIVE_GET, val)
+#define cfg_conn_has_flag(addr, flag) cfg_conn_op(addr, FLAG_CHECK, (void *)(unsigned long)(flag))
+#define cfg_conn_get_max_lifetime(addr, val) cfg_conn_op(addr, MAX_LIFETIME_GET, val)
+#define cfg_conn_get_keepalive(addr, val) cfg_conn_op(addr, KEEPALIVE_GET, val)
+#define cfg_conn_observe_handout(addr, sample) cfg_conn_op(addr, HANDOUT_OBSERVE, sample)
+#define cfg_conn_learn_sockopts(addr, opts) cfg_conn_op(addr, SOCKOPTS_LEARN, opts)
+#define cfg_conn_get_sockopts(addr, opts) cfg_conn_op(addr, SOCKOPTS_GET, opts)
+#define cfg_conn_get_queue_timeout(addr, val) cfg_conn_op(addr, QUEUE_TIMEOUT_GET, val)
+#define cfg_conn_observe_queue(addr, sample) cfg_conn_op(addr, QUEUE_OBSERVE, sample)
+#define cfg_conn_active_acquire(addr, err) cfg_conn_op(addr, ACTIVE_ACQUIRE, err)
+#define cfg_conn_active_add(addr, delta) cfg_conn_op(addr, ACTIVE_ADD, (void *)(long)(delta))
+#define cfg_conn_observe_breaker(addr, event) cfg_conn_op(addr, BREAKER_OBSERVE, (void *)(unsigned long)(event))
+#define cfg_conn_breaker_allow(addr, err) cfg_conn_op(addr, BREAKER_ALLOW, err)
+#define cfg_conn_get_group_members(addr, members) cfg_conn_op(addr, GROUP_MEMBERS_GET, members)
+#define cfg_conn_observe_hot(addr, hit) cfg_conn_op(addr, HOT_OBSERVE, (void *)(unsigned long)(hit))
+#define cfg_conn_inc_hot_stat(addr, stat) cfg_conn_op(addr, HOT_STAT_INC, (void *)(unsigned long)(stat))
+#define cfg_conn_preconnect_allowd(addr) cfg_conn_op(addr, PRECONNECT_CHECK, NULL)
+#define cfg_conn_add_handout_rejects(addr, rejects) cfg_conn_op(addr, HANDOUT_REJECTS_ADD, rejects)
 
 extern int cfg_conn_op(struct sockaddr *addr, int op_type, void *val);
 
+/**
+ *The preconnects of the iport allowed by the breaker, the half-open probe is 1.
+ *The nums pass through on the wildcard entry which has no breaker.
+ */
+extern int cfg_conn_breaker_preconnect(struct conn_node_t *conn_node, int nums);
+
+/**
+ *Rank the destinations of the wildcard entry, the top ones short of the spare
+ *conns are pending to preconnect. Returns the pending preconnects.
+ */
+extern int cfg_conn_hot_preconnect(struct conn_node_t *conn_node, int min_spare);
+
+/**
+ *Take the pending preconnects of the hot destinations, returns the destinations.
+ */
+extern int cfg_conn_hot_preconnect_take(struct conn_node_t *conn_node, 
+        struct sockaddr_in *addrs, int *nums);
+
+/*Prefilter of the white list, rebuilt on the cfg reload*/
+#define CFG_PREFILTER_PORTS 65536
+#define CFG_PREFILTER_IP_BLOOM_SHIFT 12 //4096 bits
+#define CFG_PREFILTER_IP_BLOOM_BITS (1U << CFG_PREFILTER_IP_BLOOM_SHIFT)
+
+#define CFG_PREFILTER_IP_HASH1(ip) hash_32((u32)(ip), CFG_PREFILTER_IP_BLOOM_SHIFT)
+#define CFG_PREFILTER_IP_HASH2(ip) hash_32((u32)(ip) ^ 0x9e3779b9, CFG_PREFILTER_IP_BLOOM_SHIFT)
+
+struct cfg_prefilter_t {
+    unsigned long ports[BITS_TO_LONGS(CFG_PREFILTER_PORTS)];
+    unsigned long wildcard_ports[BITS_TO_LONGS(CFG_PREFILTER_PORTS)];
+    unsigned long ips[BITS_TO_LONGS(CFG_PREFILTER_IP_BLOOM_BITS)]; //bloom filter
+};
+
+extern struct cfg_prefilter_t __rcu *cfg_prefilter;
+
+/**
+ *Returns 0 if the ip and port are surely not in the white list.
+ *The reload reuses the spare one after the readers of it are gone.
+ */
+static inline int cfg_conn_prefilter_passed(unsigned int ip, unsigned short int port)
+{
+    struct cfg_prefilter_t *pf;
+    unsigned int p = ntohs(port);
+    int ret;
+
+    rcu_read_lock();
+
+    pf = rcu_dereference(cfg_prefilter);
+
+    if (!pf || !test_bit(p, pf->ports))
+        ret = 0;
+    else if (test_bit(p, pf->wildcard_ports))
+        ret = 1;
+    else
+        ret = test_bit(CFG_PREFILTER_IP_HASH1(ip), pf->ips)
+            && test_bit(CFG_PREFILTER_IP_HASH2(ip), pf->ips);
+
+    rcu_read_unlock();
+
+    return ret;
+}
+
+#define cfg_conn_prefilter(addr) \
+    cfg_conn_prefilter_passed(SOCKADDR_IP(addr), SOCKADDR_PORT(addr))
+
 extern void cfg_allowed_entries_for_each_call(void (*call_func)(void *data));
+extern void cfg_allowed_entries_for_each_call_arg(void (*call_func)(void *data, void *arg), void *arg);
 
 extern void cfg_allowd_iport_node_for_each_call(unsigned int ip, unsigned short int port ,void (*call_func)(void *data));
 
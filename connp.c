@@ -1,7 +1,9 @@
+#include <linux/module.h>
 #include <linux/jiffies.h>
 #include <linux/sched.h>
 #include <linux/in.h>
 #include <net/sock.h>
+#include <net/inet_common.h>
 #include <linux/spinlock.h>
 #include "sys_call.h"
 #include "lkm_util.h"
@@ -9,8 +11,10 @@
 #include "sockp.h"
 #include "connp.h"
 #include "connpd.h"
+#include "saddr_cache.h"
 
-rwlock_t connp_rwlock; //global connp r/w lock;
+struct srcu_struct connp_srcu; //global connp lock;
+volatile int connp_wlocked;
 
 static void do_conn_spec_check_close_flag(void *data);
 static void do_conn_inc_all_count(void *data);
@@ -23,6 +27,11 @@ static inline int insert_into_connp(struct sockaddr *, struct sockaddr *, struct
 
 static inline void deferred_destroy(void);
 
+static struct proto_ops connp_inet_stream_ops; //reclaim the sk at the sock release.
+
+static inline int connp_sock_ops_set(struct socket *);
+static inline void connp_sock_ops_reset(struct socket *);
+
 static int conn_close_flag; 
 static void do_conn_spec_check_close_flag(void *data)
 {
@@ -68,6 +77,9 @@ static void do_conn_inc_connected_miss_count(void *data)
     struct conn_node_t *conn_node = (typeof(conn_node))data;
     
     lkm_atomic_add(&conn_node->conn_connected_miss_count, 1);
+
+    if (conn_node->conn_preferred_node != numa_node_id())
+        conn_node->conn_preferred_node = numa_node_id();
 }
 
 static void do_conn_inc_connected_hit_count(void *data)
@@ -75,6 +87,16 @@ static void do_conn_inc_connected_hit_count(void *data)
     struct conn_node_t *conn_node = (typeof(conn_node))data;
 
     lkm_atomic_add(&conn_node->conn_connected_hit_count, 1);
+
+    if (conn_node->conn_preferred_node != numa_node_id())
+        conn_node->conn_preferred_node = numa_node_id();
+}
+
+static void do_conn_inc_group_hit_count(void *data)
+{
+    struct conn_node_t *conn_node = (typeof(conn_node))data;
+
+    lkm_atomic_add(&conn_node->conn_group_hit_count, 1);
 }
 
 int conn_inc_count(struct sockaddr *addr, int count_type)
@@ -94,12 +116,49 @@ int conn_inc_count(struct sockaddr *addr, int count_type)
        conn_inc_count_func = do_conn_inc_connected_hit_count;
    else if (count_type == CONNECTED_MISS_COUNT)
        conn_inc_count_func = do_conn_inc_connected_miss_count;
+   else if (count_type == GROUP_HIT_COUNT)
+       conn_inc_count_func = do_conn_inc_group_hit_count;
 
    cfg_allowd_iport_node_for_each_call(ip, port, conn_inc_count_func); 
 
+   if (count_type == ALL_COUNT)
+       cfg_conn_inc_hot_stat(addr, CONN_HOT_POOLED);
+   else if (count_type == IDLE_COUNT)
+       cfg_conn_inc_hot_stat(addr, CONN_HOT_IDLE);
+
    return 1;
 }
 
+/**
+ *The sock leaves the user, drop it from the active conns of the iport.
+ */
+static inline void connp_sock_active_put(struct socket *sock, struct sockaddr *servaddr)
+{
+    if (!IS_ACTIVE_SOCK(sock))
+        return;
+
+    CLEAR_ACTIVE_FLAG(sock);
+    cfg_conn_active_add(servaddr, -1);
+}
+
+/**
+ *Put by the server address of the sk, it is kept after the connect failed asynchronously.
+ */
+static inline void connp_sock_active_put_sk(struct socket *sock)
+{
+    struct sockaddr_in servaddr;
+
+    if (!IS_ACTIVE_SOCK(sock))
+        return;
+
+    memset(&servaddr, 0, sizeof(servaddr));
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_addr.s_addr = SK_DADDR(sock->sk);
+    servaddr.sin_port = SK_DPORT(sock->sk);
+
+    connp_sock_active_put(sock, (struct sockaddr *)&servaddr);
+}
+
 static inline int insert_socket_to_connp(struct sockaddr *cliaddr, struct sockaddr *servaddr, struct socket *sock)
 {
     int connpd_fd;
@@ -116,6 +175,8 @@ static inline int insert_socket_to_connp(struct sockaddr *cliaddr, struct sockad
         return 0;
     }
 
+    connp_sock_ops_reset(sock);
+
     return 1;
 }
 
@@ -130,93 +191,424 @@ static inline int insert_into_connp(struct sockaddr *cliaddr, struct sockaddr *s
     //To free
     if (free_sk_to_sockp(sock->sk)) {
         sock->sk = NULL; //Remove reference to avoid to destroy the sk.
+        connp_sock_active_put(sock, servaddr);
         return 1;
     }
     
     //To insert
-    if (insert_socket_to_connp(cliaddr, servaddr, sock))
+    if (insert_socket_to_connp(cliaddr, servaddr, sock)) {
+        connp_sock_active_put(sock, servaddr);
         return 1;
+    }
 
     return 0;
 }
 
-int insert_into_connp_if_permitted(int fd)
+typedef enum {
+    RECLAIM_NONE = 0,
+    RECLAIM_INSERT,
+    RECLAIM_CLOSE
+} reclaim_way_t;
+
+/**
+ *Fast filter by the file and the sk fields only, no lock needed.
+ */
+static inline struct socket *connp_reclaim_sock_filter(int fd)
 {
+    struct file *filp;
     struct socket *sock;
-    struct sockaddr cliaddr;
-    struct sockaddr servaddr;
-    int err;
 
-    connp_rlock();
+    filp = lkm_get_file(fd);
+    if (!filp 
+            || !IS_CLIENT_FILE(filp)
+            || !is_sock_file(filp))
+        return NULL;
 
-    if (!CONNP_DAEMON_EXISTS() || INVOKED_BY_CONNP_DAEMON())
-        goto ret_fail;
+    sock = (struct socket *)filp->private_data;
+    if (!sock 
+            || !sock->sk
+            || !IS_TCP_SOCK(sock)
+            || !IS_TCP_SK(sock->sk))
+        return NULL;
 
-    if (!is_sock_fd(fd))
-        goto ret_fail;
+    //The unconfigured destinations exit here.
+    if (!cfg_conn_prefilter_passed(SK_DADDR(sock->sk), SK_DPORT(sock->sk)))
+        return NULL;
 
-    sock = getsock(fd);
-    if (!sock 
-            || !IS_TCP_SOCK(sock) 
-            || !IS_CLIENT_SOCK(sock))
-        goto ret_fail;
+    return sock;
+}
 
-    if (!getsockcliaddr(sock, &cliaddr)) 
-        goto ret_fail;
+/**
+ *Check the way to reclaim the sock, must be called with the connp rlock.
+ */
+static reclaim_way_t connp_reclaim_sock_check(struct socket *sock, 
+        struct sockaddr *cliaddr, struct sockaddr *servaddr)
+{
+    if (!getsockcliaddr(sock, cliaddr)) 
+        return RECLAIM_NONE;
 
-    if (!getsockservaddr(sock, &servaddr))
-        goto ret_fail;
+    if (!getsockservaddr(sock, servaddr))
+        return RECLAIM_NONE;
 
     //only stand for ipv4
-    if (cliaddr.sa_family != AF_INET) 
-        goto ret_fail;
-
-    if (servaddr.sa_family != AF_INET)
-        goto ret_fail;
+    if (cliaddr->sa_family != AF_INET) 
+        return RECLAIM_NONE;
 
-    if (!cfg_conn_is_positive(&servaddr))
-        goto sock_close;
+    if (servaddr->sa_family != AF_INET)
+        return RECLAIM_NONE;
 
+    //The evidences of the passive iport are kept even if the iport is passive.
+    //Once a sock, the release after a hook not pooling it checks it again.
     if (!SOCK_ESTABLISHED(sock)) {
-        cfg_conn_set_passive(&servaddr); //may be passive sock.
-        goto sock_close;
+        if (!IS_OBSERVED_SOCK(sock))
+            connpd_server_close_notify(servaddr); //closed by the server.
+        SET_OBSERVED_FLAG(sock);
+        return RECLAIM_CLOSE;
     }
 
-    err = insert_into_connp(&cliaddr, &servaddr, sock);
-    
-    connp_runlock();
+    if (!IS_OBSERVED_SOCK(sock))
+        cfg_conn_observe_close(servaddr, CONN_CLOSE_CLEAN);
+    SET_OBSERVED_FLAG(sock);
+
+    if (!cfg_conn_is_positive(servaddr))
+        return RECLAIM_CLOSE;
+
+    return RECLAIM_INSERT;
+}
+
+int insert_into_connp_if_permitted(int fd)
+{
+    struct socket *sock;
+    struct sockaddr cliaddr;
+    struct sockaddr servaddr;
+    int err = 0;
+    int idx;
+
+    sock = connp_reclaim_sock_filter(fd);
+    if (!sock)
+        return 0;
+
+    idx = connp_rlock();
+
+    if (CONNP_WLOCKED() || !CONNP_DAEMON_EXISTS() || INVOKED_BY_CONNP_DAEMON())
+        goto ret_unlock;
+
+    switch (connp_reclaim_sock_check(sock, &cliaddr, &servaddr)) {
+        case RECLAIM_INSERT:
+            err = insert_into_connp(&cliaddr, &servaddr, sock);
+            break;
+        case RECLAIM_CLOSE:
+            set_sock_close_now(sock, 1); //posted to connpd to close.
+            break;
+        default:
+            break;
+    }
+
+ret_unlock:
+    connp_runlock(idx);
     return err;
+}
+
+/**
+ *Move the sk of the released sock to a new sock of connpd, and insert it to sockp.
+ */
+static int insert_sk_to_connp(struct sockaddr *cliaddr, struct sockaddr *servaddr, struct socket *sock)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 7, 10)
+    struct socket *nsock;
+    struct file *filp;
+    struct sock *sk;
+    int connpd_fd;
+
+    connpd_fd = connpd_get_unused_fd();
+    if (connpd_fd < 0)
+        return 0;
+
+    if (sock_create_lite(AF_INET, SOCK_STREAM, IPPROTO_TCP, &nsock) < 0)
+        goto put_fd;
+
+    nsock->ops = &inet_stream_ops;
+    nsock->state = sock->state;
 
-sock_close:
-    set_sock_close_now(sock, 1);
-    notify(CONNP_DAEMON_TSKP); //wake up connpd to nonconnection collection.
+    filp = lkm_sock_alloc_file(nsock);
+    if (IS_ERR(filp))
+        goto put_fd;
 
-ret_fail:
-    connp_runlock();
+    sk = sock->sk;
+    sock->sk = NULL; //Remove reference to avoid to destroy the sk.
+    sock_graft(sk, nsock);
+
+    task_fd_install(CONNP_DAEMON_TSKP, connpd_fd, filp);
+
+    if (!insert_sock_to_sockp(cliaddr, servaddr, nsock, connpd_fd, SOCK_RECLAIM))
+        connpd_close_pending_fds_in(connpd_fd);
+
+    return 1;
+
+put_fd:
+    connpd_unused_fds_in(connpd_fd);
+#endif
     return 0;
 }
 
+/**
+ *The release of the last file reference, whichever way it happens.
+ */
+static int connp_sock_release(struct socket *sock)
+{
+    struct sockaddr cliaddr;
+    struct sockaddr servaddr;
+    int idx;
+
+    if (!sock->sk || !IS_TCP_SK(sock->sk))
+        goto release;
+
+    connp_sock_active_put_sk(sock);
+
+    idx = connp_rlock();
+
+    if (CONNP_WLOCKED() || !CONNP_DAEMON_EXISTS())
+        goto ret_unlock;
+
+    switch (connp_reclaim_sock_check(sock, &cliaddr, &servaddr)) {
+        case RECLAIM_INSERT:
+            //To free
+            if (free_sk_to_sockp(sock->sk)) {
+                sock->sk = NULL; //Remove reference to avoid to destroy the sk.
+                break;
+            }
+            //To insert
+            insert_sk_to_connp(&cliaddr, &servaddr, sock);
+            break;
+        case RECLAIM_CLOSE:
+            set_sock_close_now(sock, 1); //posted to connpd to close.
+            break;
+        default:
+            break;
+    }
+
+ret_unlock:
+    connp_runlock(idx);
+
+release:
+    return inet_stream_ops.release(sock);
+}
+
+static inline int connp_sock_ops_set(struct socket *sock)
+{
+    __module_get(THIS_MODULE); //put by sock_release or the ops reset.
+
+    if (cmpxchg(&sock->ops, &inet_stream_ops, 
+                (const struct proto_ops *)&connp_inet_stream_ops) != &inet_stream_ops) {
+        module_put(THIS_MODULE);
+        return 0;
+    }
+
+    return 1;
+}
+
+static inline void connp_sock_ops_reset(struct socket *sock)
+{
+    if (cmpxchg(&sock->ops, (const struct proto_ops *)&connp_inet_stream_ops, 
+                &inet_stream_ops) == &connp_inet_stream_ops)
+        module_put(THIS_MODULE);
+}
+
+static void connp_sock_ops_init(void)
+{
+    memcpy(&connp_inet_stream_ops, &inet_stream_ops, sizeof(struct proto_ops));
+
+    connp_inet_stream_ops.owner = THIS_MODULE;
+    connp_inet_stream_ops.release = connp_sock_release;
+}
+
+struct connp_reclaim_batch_t {
+    int count;
+    struct sockp_batch_ent_t ents[SOCKP_BATCH_SIZE];
+};
+
+static void connp_reclaim_batch_flush(struct connp_reclaim_batch_t *batch)
+{
+    struct sockp_batch_ent_t *ent;
+    int n = batch->count;
+    int i;
+
+    if (!n)
+        return;
+
+    batch->count = 0;
+
+    //To free
+    if (free_sks_to_sockp(batch->ents, n) == n) {
+        for (i = 0; i < n; i++) {
+            batch->ents[i].sock->sk = NULL; //Remove reference to avoid to destroy the sk.
+            connp_sock_active_put(batch->ents[i].sock, &batch->ents[i].servaddr);
+        }
+        return;
+    }
+
+    //To insert
+    for (i = 0; i < n; i++) {
+        ent = &batch->ents[i];
+
+        if (ent->sb) {
+            ent->sock->sk = NULL;
+            connp_sock_active_put(ent->sock, &ent->servaddr);
+            continue;
+        }
+
+        ent->connpd_fd = connpd_get_unused_fd();
+        if (ent->connpd_fd < 0)
+            continue;
+
+        task_fd_install(CONNP_DAEMON_TSKP, ent->connpd_fd, ent->sock->file);
+        file_count_inc(ent->sock->file); //add file reference count.
+    }
+
+    insert_socks_to_sockp(batch->ents, n);
+
+    for (i = 0; i < n; i++) {
+        ent = &batch->ents[i];
+
+        if (ent->connpd_fd < 0)
+            continue;
+
+        if (ent->sb) {
+            connp_sock_ops_reset(ent->sock);
+            connp_sock_active_put(ent->sock, &ent->servaddr);
+        } else
+            connpd_close_pending_fds_in(ent->connpd_fd);
+    }
+}
+
+static void connp_reclaim_fd(int fd, void *data)
+{
+    struct connp_reclaim_batch_t *batch = (struct connp_reclaim_batch_t *)data;
+    struct sockp_batch_ent_t *ent;
+    struct socket *sock;
+
+    sock = connp_reclaim_sock_filter(fd);
+    if (!sock)
+        return;
+
+    ent = &batch->ents[batch->count];
+
+    switch (connp_reclaim_sock_check(sock, &ent->cliaddr, &ent->servaddr)) {
+        case RECLAIM_INSERT:
+            if (file_count_read(sock->file) != 1)
+                break;
+
+            ent->sock = sock;
+            ent->connpd_fd = -1;
+            ent->sb = NULL;
+
+            if (++batch->count == SOCKP_BATCH_SIZE)
+                connp_reclaim_batch_flush(batch);
+            break;
+        case RECLAIM_CLOSE:
+            set_sock_close_now(sock, 1); //posted to connpd to close.
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ *Get the source address of the unbound client by the cache at first.
+ */
+static int getlocaladdr_cached(struct socket *sock, struct sockaddr *cliaddr, struct sockaddr *servaddr)
+{
+    struct saddr_cache_key_t key;
+    __be32 saddr;
+    int ret;
+
+    memset(&key, 0, sizeof(key));
+    key.daddr = SOCKADDR_IP(servaddr);
+
+    if (SK_HAS_IP_OPTS(sock->sk)) //Source routed, not cached.
+        return getsocklocaladdr(sock, cliaddr, servaddr);
+
+    key.net = sock_net(sock->sk);
+    key.oif = sock->sk->sk_bound_dev_if;
+    key.mark = sock->sk->sk_mark;
+    key.tos = RT_CONN_FLAGS(sock->sk);
+
+    if (saddr_cache_lookup(&key, &saddr)) {
+        SOCKADDR_IP(cliaddr) = saddr;
+        return 1;
+    }
+
+    ret = getsocklocaladdr(sock, cliaddr, servaddr);
+
+    if (ret)
+        saddr_cache_update(&key, SOCKADDR_IP(cliaddr));
+
+    return ret;
+}
+
+/**
+ *A miss of the grouped iport is served by the idle sock of another member.
+ *The sk keeps its own peer, so getpeername() reports the member really connected,
+ *and the active conn moves to it to be put by the peer at the release.
+ */
+static struct socket_bucket *apply_sk_from_group(struct sockaddr *cliaddr, 
+        struct sockaddr *servaddr, u32 fingerprint)
+{
+    struct conn_group_members_t members;
+    struct sockaddr *member;
+    struct socket_bucket *sb;
+    int i, start;
+
+    if (!cfg_conn_get_group_members(servaddr, &members))
+        return NULL;
+
+    start = lkm_random32() % members.nums; //spread the borrows over the members.
+
+    for (i = 0; i < members.nums; i++) {
+
+        member = (struct sockaddr *)&members.addrs[(start + i) % members.nums];
+
+        sb = apply_sk_from_sockp(cliaddr, member, fingerprint);
+        if (!sb)
+            continue;
+
+        cfg_conn_active_add(servaddr, -1);
+        cfg_conn_active_add(member, 1);
+
+        conn_inc_group_hit_count(servaddr);
+
+        return sb;
+    }
+
+    return NULL;
+}
+
 int fetch_conn_from_connp(int fd, struct sockaddr *servaddr)
 {
     struct sockaddr cliaddr;
+    struct file *filp;
     struct socket *sock;
     struct socket_bucket *sb;
+    u32 fingerprint = 0;
+    u64 queue_timeout = 0;
+    int active_errno = 0;
     int ret = 0; 
-    
+    int idx;
 
-    connp_rlock(); 
+    idx = connp_rlock(); 
 
-    if (!CONNP_DAEMON_EXISTS()) {
+    if (CONNP_WLOCKED() || !CONNP_DAEMON_EXISTS()) {
         ret = 0;
         goto ret_unlock;
     }
 
-    if (!is_sock_fd(fd)) {
+    filp = lkm_get_file(fd);
+    if (!filp || !is_sock_file(filp)) {
         ret = 0;
         goto ret_unlock;
     }
 
-    sock = getsock(fd);
+    sock = (struct socket *)filp->private_data;
     if (!sock 
             || !sock->sk
             || !IS_TCP_SOCK(sock) 
@@ -241,14 +633,46 @@ int fetch_conn_from_connp(int fd, struct sockaddr *servaddr)
 
     if (SOCKADDR_IP(&cliaddr) == htonl(INADDR_ANY)) { // address not bind before connect
         //get local sock client addr
-        if (!getsocklocaladdr(sock, &cliaddr, servaddr)) {
+        if (!getlocaladdr_cached(sock, &cliaddr, servaddr)) {
             ret = 0;
             goto ret_unlock;
         }
 
     }
 
-    if ((sb = apply_sk_from_sockp((struct sockaddr *)&cliaddr, servaddr))) {
+    if (cfg_conn_has_flag(servaddr, CONN_FINGERPRINT))
+        fingerprint = lkm_sk_fingerprint(sock->sk);
+
+    //The breaker is open, fail over at once instead of the connect timeout.
+    if (!cfg_conn_breaker_allow(servaddr, &active_errno) && active_errno) {
+        ret = -active_errno;
+        goto ret_unlock;
+    }
+
+    if (cfg_conn_active_acquire(servaddr, &active_errno) || !active_errno) {
+
+        sb = apply_sk_from_sockp((struct sockaddr *)&cliaddr, servaddr, fingerprint);
+
+        if (!sb)
+            sb = apply_sk_from_group((struct sockaddr *)&cliaddr, servaddr, fingerprint);
+
+        //Queue mode: the blocking connect waits for a returning sock before the real connect.
+        if (!sb && CONN_QUEUE_TIMEOUT(sock, servaddr, queue_timeout))
+            sb = wait_sk_from_sockp((struct sockaddr *)&cliaddr, servaddr, fingerprint, (long)queue_timeout);
+
+    } else { //Over the ceiling, only a returning sock is served, no new conn to the server.
+
+        if (!CONN_QUEUE_TIMEOUT(sock, servaddr, queue_timeout)
+                || !(sb = wait_sk_from_sockp((struct sockaddr *)&cliaddr, servaddr, 
+                        fingerprint, (long)queue_timeout))) {
+            ret = -active_errno;
+            goto ret_unlock;
+        }
+
+        cfg_conn_active_add(servaddr, 1); //the returning one is put already.
+    }
+
+    if (sb) {
        
         //Destroy the pre-create sk 
         sock_destroy(sock->sk);
@@ -257,7 +681,8 @@ int fetch_conn_from_connp(int fd, struct sockaddr *servaddr)
 
         SET_SOCK_STATE(sock, SS_CONNECTED);
 
-        if (CONN_IS_NONBLOCK(sock->file)) 
+        //The sk is established, the nonblock connect may return 0 at once.
+        if (CONN_IS_NONBLOCK(sock->file) && !CONN_NONBLOCK_IMMEDIATE(servaddr)) 
             ret = CONN_NONBLOCK;
         else
             ret = CONN_BLOCK;
@@ -266,23 +691,84 @@ int fetch_conn_from_connp(int fd, struct sockaddr *servaddr)
     } else
         conn_inc_connected_miss_count(servaddr);
 
+    cfg_conn_observe_hot(servaddr, sb != NULL); //the destinations of the wildcard entry.
+
+    connpd_work_notify(CONNPD_WORK_STATS);
+
     SET_CLIENT_FLAG(sock);
 
+    //reclaim it at the release if not closed by the hooks.
+    if (connp_sock_ops_set(sock))
+        SET_ACTIVE_FLAG(sock); //put at the reclaim or the release.
+    else if (sb) { //no release hook to put it, by the peer of the sk maybe a group member.
+        SET_ACTIVE_FLAG(sock);
+        connp_sock_active_put_sk(sock);
+    } else
+        cfg_conn_active_add(servaddr, -1); //no release hook to put it.
+
 ret_unlock:
-    connp_runlock();
+    connp_runlock(idx);
     return ret;
 }
 
+/**
+ *The real connect of the miss returned, fed to the breaker. The failed one is put at once, 
+ *its sk forgets the server address.
+ */
+void connp_connect_result(int fd, struct sockaddr *servaddr, int err)
+{
+    struct file *filp;
+    struct socket *sock;
+    int idx;
+
+    idx = connp_rlock();
+
+    filp = lkm_get_file(fd);
+    if (!filp || !IS_CLIENT_FILE(filp) || !is_sock_file(filp))
+        goto ret_unlock;
+
+    sock = (struct socket *)filp->private_data;
+    if (!sock)
+        goto ret_unlock;
+
+    switch (err) {
+        case 0:
+            cfg_conn_observe_breaker(servaddr, CONN_BREAKER_SUCCESS);
+            goto ret_unlock; //still active.
+        case -ECONNREFUSED:
+        case -ECONNRESET:
+        case -ETIMEDOUT:
+        case -EHOSTUNREACH:
+        case -ENETUNREACH:
+            cfg_conn_observe_breaker(servaddr, CONN_BREAKER_FAILURE);
+            break;
+        default:
+            break;
+    }
+
+    connp_sock_active_put(sock, servaddr);
+
+ret_unlock:
+    connp_runlock(idx);
+}
+
 void connp_sys_exit_prepare()
 {
-    struct fd_entry *pos, *tmp;
-
-    LIST_HEAD(fds_list);
-    TASK_GET_FDS(current, &fds_list);
-    list_for_each_entry_safe(pos, tmp, &fds_list, siblings) {
-        insert_into_connp_if_permitted(pos->fd);
-        lkmfree(pos);
-    } 
+    struct connp_reclaim_batch_t batch;
+    int idx;
+
+    idx = connp_rlock();
+
+    if (CONNP_WLOCKED() || !CONNP_DAEMON_EXISTS() || INVOKED_BY_CONNP_DAEMON())
+        goto ret_unlock;
+
+    batch.count = 0;
+
+    TASK_FDS_FOR_EACH_CALL(current, connp_reclaim_fd, &batch);
+    connp_reclaim_batch_flush(&batch);
+
+ret_unlock:
+    connp_runlock(idx);
 }
 
 static inline void deferred_destroy(void) 
@@ -294,30 +780,51 @@ static inline void deferred_destroy(void)
 
 int connp_init()
 {
-    connp_rwlock_init();
+    if (!connp_lock_init()) {
+        printk(KERN_ERR "Error: connp_lock_init error!");
+        return 0;
+    }
 
     if (!cfg_init()) {
+        connp_lock_destroy();
         printk(KERN_ERR "Error: cfg_init error!");
         return 0;
     }
 
+    lkm_socket_file_ops_init();
+
+    if (!saddr_cache_init()) {
+        cfg_destroy();
+        connp_lock_destroy();
+        printk(KERN_ERR "Error: saddr_cache_init error!");
+        return 0;
+    }
+
     if (!sockp_init()) {
+        saddr_cache_destroy();
         cfg_destroy();
+        connp_lock_destroy();
         printk(KERN_ERR "Error: sockp_init error!");
         return 0;
     }
 
     if (!connpd_init()) {
         sockp_destroy();
+        saddr_cache_destroy();
         cfg_destroy();
+        connp_lock_destroy();
         printk(KERN_ERR "Error: create connp daemon thread error!");
         return 0;
     }
 
+    connp_sock_ops_init();
+
     if (!replace_syscalls()) {
         connpd_destroy();
         sockp_destroy();
+        saddr_cache_destroy();
         cfg_destroy();
+        connp_lock_destroy();
         printk(KERN_ERR "Error: replace_syscalls error!");
         return 0;
     }
@@ -330,6 +837,8 @@ void connp_destroy()
     restore_syscalls();
     connpd_destroy();
     sockp_destroy();
+    saddr_cache_destroy();
     cfg_destroy();
     deferred_destroy();//Make sure all threads exit the kconnp routines.
+    connp_lock_destroy();
 }
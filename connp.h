@@ -3,43 +3,230 @@
 
 #include <linux/file.h>
 #include <linux/sched.h>
+#include <linux/srcu.h>
 #include "sockp.h"
 
 #define CONN_BLOCK    1
 #define CONN_NONBLOCK 2
 #define CONN_IS_NONBLOCK(filp) ((filp)->f_flags & O_NONBLOCK)
 
+//The queue timeout of the blocking connect, the nonblock one never waits.
+#define CONN_QUEUE_TIMEOUT(sock, addr, timeout)                 \
+    (!CONN_IS_NONBLOCK((sock)->file)                             \
+     && cfg_conn_get_queue_timeout(addr, &(timeout)) && (timeout))
+
 //cfg flags
 #define CONN_STATEFUL (1<<0) //stateful connection
+#define CONN_IMMEDIATE (1<<1) //nonblock connect returns 0 at once on the hit
+#define CONN_KEEP_CWND (1<<2) //no slow start restart after the idle in the pool
+#define CONN_FINGERPRINT (1<<3) //match the routing options of the sock in the pool key
+
+#define CONN_NONBLOCK_IMMEDIATE(addr) \
+    (GN("nonblock_connect_immediate") || cfg_conn_has_flag(addr, CONN_IMMEDIATE))
 
 #define CONN_PASSIVE_TIMEOUT_JIFFIES_THRESHOLD (60 * HZ) /*1 minute*/
 
+#define CONN_FLAG_PARAMS_MAX 3 /*e.g. X1-2-3*/
+
+/*The params of the cfg flags with the values*/
+struct conn_params_t {
+    unsigned int max_lifetime; /*L<seconds>, 0: the global max_connection_lifetime*/
+    unsigned int keepalive_idle; /*K<idle>-<intvl>-<cnt>, seconds, 0: no keepalive in the pool*/
+    unsigned int keepalive_intvl; /*seconds*/
+    unsigned int keepalive_cnt; /*probes*/
+    unsigned int queue_timeout; /*Q<ms>, the blocking connect waits for a returning sock, 0: no wait*/
+    unsigned int active_ceiling; /*C<n>, the max active conns, 0: unlimited*/
+    unsigned int active_errno; /*E<errno>, the connect over the ceiling or the breaker fails with*/
+    unsigned int breaker_failures; /*B<failures>-<seconds>, the failures in a row to open, 0: no breaker*/
+    unsigned int breaker_open; /*seconds in the open state before the half-open probe*/
+    unsigned int group; /*G<id>-<min>-<max>, the group of the equivalent iports, 0: no group*/
+    unsigned int group_min_spare; /*the spare conns of the whole group*/
+    unsigned int group_max_spare;
+};
+
+#define CONN_GROUPS_MAX 64 /*the group ids are 1..CONN_GROUPS_MAX*/
+#define CONN_GROUP_MEMBERS_MAX 16 /*the other members tried on a miss*/
+
+/*The other members of the group of an iport, their idle socks serve its connects*/
+struct conn_group_members_t {
+    int nums;
+    struct sockaddr_in addrs[CONN_GROUP_MEMBERS_MAX];
+};
+
+#define CONN_LIFETIME_JITTER_PERCENT \
+    ({long __p = GN("connection_lifetime_jitter"); __p < 0 ? 0 : (__p > 100 ? 100 : __p);})
+
+/*The tcp state of the sock at the handout*/
+struct conn_handout_sample_t {
+    unsigned int cwnd; /*segments*/
+    unsigned int srtt_us;
+    int cwnd_kept; /*the slow start restart skipped*/
+};
+
+#define CONN_HANDOUT_EWMA_SHIFT 3 /*1/8 weight of the new sample*/
+
+/*The circuit breaker of the iport driven by the handshake failures and the RSTs*/
+typedef enum {
+    CONN_BREAKER_CLOSED = 0, /*the connects pass*/
+    CONN_BREAKER_OPEN, /*the connects fail at once*/
+    CONN_BREAKER_HALF_OPEN /*a probe is running, the connects fail at once*/
+} conn_breaker_state_t;
+
+typedef enum {
+    CONN_BREAKER_SUCCESS = 0,
+    CONN_BREAKER_FAILURE
+} conn_breaker_event_t;
+
+#define CONN_BREAKER_ERRNO ECONNREFUSED /*the default errno of the fast fails*/
+
+typedef enum {
+    CONN_QUEUE_ENTER = 0,
+    CONN_QUEUE_SERVED, /*got a returned sock*/
+    CONN_QUEUE_TIMEOUT /*fall back to the connect*/
+} conn_queue_event_t;
+
+struct conn_queue_sample_t {
+    conn_queue_event_t event;
+    unsigned int wait_us;
+};
+
+#define CONN_LIFETIME_WARMUP (2 * HZ) /*preconnect the replacement before the expiry*/
+
+/*The histogram of the idle ages (ms) of the socks closed by the server, 4 log bins an octave*/
+#define CONN_IDLE_HIST_SUB_SHIFT 2
+#define CONN_IDLE_HIST_OCTAVES 20 /*up to ~35 minutes*/
+#define CONN_IDLE_HIST_BUCKETS (CONN_IDLE_HIST_OCTAVES << CONN_IDLE_HIST_SUB_SHIFT)
+
+#define CONN_IDLE_PERCENTILE 10 /*low percentile of the close ages as the server idle timeout*/
+#define CONN_IDLE_MIN_SAMPLES 8 /*no estimate under it*/
+#define CONN_IDLE_CONFIDENT_SAMPLES 32 /*the margin is doubled under it*/
+#define CONN_IDLE_DECAY_SAMPLES 128 /*halve the counts to follow the server changes*/
+#define CONN_IDLE_MARGIN_MAX (2 * HZ) /*refresh the idle sock before the predicted timeout*/
+
+/*The space-saving sketch of the destinations connected under a wildcard entry*/
+#define CONN_HOT_SLOTS 16 /*the destinations counted*/
+#define CONN_HOT_TOP 8 /*the most connected ones preconnected*/
+#define CONN_HOT_MIN_CONNECTS 8 /*the guaranteed connects in a decay period to be hot*/
+#define CONN_HOT_DECAY_INTERVAL (10 * HZ) /*halve the counts to follow the traffic shifts*/
+
+/*The stats of a destination since it took the slot*/
+typedef enum {
+    CONN_HOT_HITS = 0,
+    CONN_HOT_MISSES,
+    CONN_HOT_EVICTIONS, /*the idle socks closed by the pool*/
+    CONN_HOT_PASSIVES, /*the socks closed by the server*/
+    CONN_HOT_POOLED, /*counted by the running scan*/
+    CONN_HOT_IDLE, /*counted by the running scan*/
+    CONN_HOT_STATS
+} conn_hot_stat_t;
+
+struct conn_hot_slot_t {
+    unsigned int ip;
+    unsigned short int port;
+    unsigned int count; /*decayed*/
+    unsigned int error; /*the overestimation inherited from the evicted one*/
+    unsigned int stats[CONN_HOT_STATS];
+    unsigned int pooled; /*of the last scan*/
+    unsigned int idle; /*of the last scan*/
+    int hot; /*one of the top, a preconnect target*/
+    int preconnect_nums; /*pending for the node connpd thread*/
+};
+
+struct conn_hot_t {
+    spinlock_t lock; /*of the entry, the other wildcard entries never contend*/
+    struct conn_hot_slot_t slots[CONN_HOT_SLOTS];
+    unsigned long decay_jiffies;
+};
+
 typedef enum {
     CLOSE_POSITIVE = 0,
     CLOSE_PASSIVE
 } conn_close_way_t;
 
+/*The closes of the client socks observed in a sliding window to detect the passive iport*/
+#define CONN_CLOSE_WINDOW_SLOTS 8
+#define CONN_CLOSE_WINDOW_SLOT_JIFFIES (2 * HZ) /*16s window*/
+#define CONN_PASSIVE_MIN_SAMPLES 8 /*no decision under it*/
+#define CONN_PASSIVE_DEMOTE_PERCENT 50 /*server closes to demote the iport to passive*/
+#define CONN_PASSIVE_PROMOTE_PERCENT 10 /*server closes to promote the iport back*/
+
+typedef enum {
+    CONN_CLOSE_CLEAN = 0, /*closed by the client with the conn established*/
+    CONN_CLOSE_SERVER, /*closed by the server before the client close*/
+    CONN_CLOSE_KINDS
+} conn_close_kind_t;
+
 struct conn_attr_t {
     int flags;
 
+    struct conn_params_t params;
+
     struct {
         conn_close_way_t close_way;
         u64 last_set_jiffies;
     } close_way_attrs;
 
-    u64 keep_alive;
+    struct {
+        struct {
+            unsigned long epoch;
+            lkm_atomic_t count[CONN_CLOSE_KINDS];
+        } slots[CONN_CLOSE_WINDOW_SLOTS];
+
+        unsigned int demotions;
+        unsigned int promotions;
+        unsigned int last_server; /*the window of the last decision*/
+        unsigned int last_all;
+    } close_window;
+
+    u64 keep_alive; /*usable idle jiffies of the sock, the predicted server timeout minus the margin*/
     int close_now;
 
+    struct {
+        unsigned int buckets[CONN_IDLE_HIST_BUCKETS];
+        unsigned int samples; /*decayed*/
+        u64 timeout; /*predicted server idle timeout in jiffies*/
+    } idle_hist;
+
+    struct {
+        int learned;
+        struct lkm_sockopts_t opts; /*the options of the last reclaimed sock*/
+    } sockopts;
+
+    struct {
+        int state; /*conn_breaker_state_t*/
+        lkm_atomic_t failures; /*in a row*/
+        unsigned long since; /*jiffies of the last transition*/
+        unsigned int trips;
+        lkm_atomic_t fast_fails;
+    } breaker;
+
+    struct conn_hot_t *hot; /*the wildcard entry only*/
+
+    int preferred_node; /*numa node of the last consumer*/
+    lkm_atomic_t preconnect_nums; /*pending preconnects for the node connpd thread*/
+
     struct {
         unsigned int all_count;
         unsigned int idle_count;
         lkm_atomic_t connected_hit_count;
         lkm_atomic_t connected_miss_count;
+        lkm_atomic_t handout_reject_count[HANDOUT_REJECT_REASONS];
+        unsigned int handout_cwnd; /*EWMA, scaled by CONN_HANDOUT_EWMA_SHIFT*/
+        unsigned int handout_srtt_us; /*EWMA, scaled by CONN_HANDOUT_EWMA_SHIFT*/
+        lkm_atomic_t handout_cwnd_kept;
+        lkm_atomic_t active_count; /*the conns handed out or connecting through the pool*/
+        lkm_atomic_t active_throttled; /*the connects over the ceiling*/
+        lkm_atomic_t queue_depth; /*the waiters now*/
+        lkm_atomic_t queue_served;
+        lkm_atomic_t queue_timeouts;
+        unsigned int queue_wait_us; /*EWMA of the waits, scaled by CONN_HANDOUT_EWMA_SHIFT*/
+        lkm_atomic_t group_hit_count; /*the hits served by the other members of the group*/
     } stats;
 };
 
 extern int insert_into_connp_if_permitted(int fd);
 extern int fetch_conn_from_connp(int fd, struct sockaddr *);
+extern void connp_connect_result(int fd, struct sockaddr *, int err);
 
 extern void connp_sys_exit_prepare(void);
 
@@ -50,42 +237,55 @@ extern void connp_destroy(void);
 #define IDLE_COUNT 1
 #define CONNECTED_HIT_COUNT 2
 #define CONNECTED_MISS_COUNT 3
+#define GROUP_HIT_COUNT 4
 #define conn_inc_all_count(addr) conn_inc_count(addr, ALL_COUNT)
 #define conn_inc_idle_count(addr) conn_inc_count(addr, IDLE_COUNT)
 #define conn_inc_connected_hit_count(addr) conn_inc_count(addr, CONNECTED_HIT_COUNT)
 #define conn_inc_connected_miss_count(addr) conn_inc_count(addr, CONNECTED_MISS_COUNT)
+#define conn_inc_group_hit_count(addr) conn_inc_count(addr, GROUP_HIT_COUNT)
 extern int conn_inc_count(struct sockaddr *, int count_type);
 
 extern int conn_spec_check_close_flag(struct sockaddr *);
 
 extern void conn_stats_info_dump(void);
 
-extern rwlock_t connp_rwlock;
-/* connpd lock funcions */
-static inline void connp_rwlock_init(void) 
+extern struct srcu_struct connp_srcu;
+extern volatile int connp_wlocked;
+/* connpd lock funcions, the readers only touch the per-cpu counters of the srcu */
+static inline int connp_lock_init(void) 
+{
+    connp_wlocked = 0;
+    return init_srcu_struct(&connp_srcu) ? 0 : 1;
+}
+
+static inline void connp_lock_destroy(void) 
 {
-    rwlock_init(&connp_rwlock);
+    cleanup_srcu_struct(&connp_srcu);
 }
 
-static inline void connp_rlock(void)
+static inline int connp_rlock(void)
 {
-    read_lock(&connp_rwlock);
+    return srcu_read_lock(&connp_srcu);
 }
 
-static inline void connp_runlock(void)
+static inline void connp_runlock(int idx)
 {
-    read_unlock(&connp_rwlock);
+    srcu_read_unlock(&connp_srcu, idx);
 }
 
 static inline void connp_wlock(void)
 {
-    write_lock(&connp_rwlock);
+    connp_wlocked = 1;
+    synchronize_srcu(&connp_srcu); //wait for the readers in the grace period.
 }
 
 static inline void connp_wunlock(void)
 {
-    write_unlock(&connp_rwlock);
+    smp_wmb();
+    connp_wlocked = 0;
 }
+
+#define CONNP_WLOCKED() (connp_wlocked)
 /*end*/
 
 #endif
@@ -1,4 +1,8 @@
 #include <linux/kthread.h>
+#include <linux/nodemask.h>
+#include <linux/topology.h>
+#include <linux/wait.h>
+#include <linux/ktime.h>
 #include "connpd.h"
 #include "connp.h"
 #include "sockp.h"
@@ -8,25 +12,93 @@
 #include "array.h"
 
 #define CONNPD_NAME "kconnpd"
+#define CONNPD_POLLER_NAME "kconnpd/%d"
 #define CONNP_DAEMON_SET(v) (connp_daemon = (v))
 
+#define CONNPD_POLL_TIMEOUT MAX_SCHEDULE_TIMEOUT //the pollers are stopped by kconnpd every round.
+
+#define CONNPD_PRECONNECT_DELAY (HZ/10) //coalesce the spare conns consumed.
+
+#define CONNPD_ITEMS_SHIFT 10
+#define CONNPD_ITEMS_SIZE (1U << CONNPD_ITEMS_SHIFT)
+#define CONNPD_ITEMS_MASK (CONNPD_ITEMS_SIZE - 1)
+
 struct task_struct * volatile connp_daemon;
 
+/**
+ *The per numa node connpd threads, poll the pool shard and preconnect for the node.
+ *The fds are still managed by kconnpd, the kernel threads share the files.
+ */
+struct connpd_poller_t {
+    struct task_struct *tsk;
+    int nid;
+    volatile int round;
+    volatile int abort;
+    int rebuild; //the check list is refilled by a full scan
+    struct array_t *pollfd_array; //kept between the rounds
+};
+
+/**
+ *The bounded lockless queue of the work items, multiple producers and kconnpd
+ *as the only consumer. The sequence of the slot tells whether it is free or filled.
+ */
+struct connpd_item_slot_t {
+    atomic_t seq;
+    struct connpd_item_t item;
+};
+
+static struct connpd_item_slot_t connpd_items[CONNPD_ITEMS_SIZE];
+static atomic_t connpd_items_tail = ATOMIC_INIT(0); //producers
+static unsigned int connpd_items_head; //kconnpd
+
+static int connpd_sleeping; //kconnpd is going to sleep, the poster wakes it up.
+
+static unsigned long connpd_deadline; //the nearest idle timeout
+static int connpd_deadline_set;
+
+static unsigned long connpd_works; //bits of the pending works
+static unsigned long connpd_works_jiffies[CONNPD_WORKS]; //when the work became pending
+static atomic64_t connpd_works_stamp = ATOMIC64_INIT(0); //ns of the first pending immediate work
+
+static struct {
+    unsigned long wakeups;
+    unsigned long rounds;
+    unsigned long latency_samples; //the rounds woken by a stamped immediate work
+    u64 latency_sum; //ns
+    u64 latency_max; //ns
+    unsigned long items;
+    unsigned long rescans;
+} connpd_wake_stats;
+
+static atomic_t connpd_items_overflows = ATOMIC_INIT(0);
+
+static struct connpd_poller_t connpd_pollers[MAX_NUMNODES];
+static atomic_t connpd_pollers_busy = ATOMIC_INIT(0);
+static DECLARE_WAIT_QUEUE_HEAD(connpd_pollers_wq);
+
 static int connpd_func(void *data);
 static int connpd_start(void);
 static void connpd_stop(void);
 
+static int connpd_poller_func(void *data);
+static int connpd_pollers_start(void);
+static void connpd_pollers_stop(void);
+static void connpd_pollers_run(int rebuild);
+static void connpd_pollers_sync(void);
+
 static int connpd_do_poll(void *data, poll_table *pt);
-static void connp_wait_events_or_timout(void);
+static void connp_wait_events_or_timout(struct connpd_poller_t *poller);
 
 static void connpd_unused_fds_prefetch(void);
 static void connpd_unused_fds_put(void);
 
+static void connpd_wait_works(void);
+
 #define CLOSE_ALL 0
 #define CLOSE_TIMEOUT 1
 #define close_all_files() do_close_files(CLOSE_ALL)
 #define close_timeout_files() do_close_files(CLOSE_TIMEOUT)
-static void do_close_files(int close_type);
+static long do_close_files(int close_type);
 
 struct stack_t *connpd_close_pending_fds, 
                *connpd_unused_fds;
@@ -71,18 +143,292 @@ static void connpd_unused_fds_put()
         put_unused_fd(fd);
 }
 
-static void do_close_files(int close_type)
+static void close_pending_files(void)
 {
     int fd;
 
+    while ((fd = connpd_close_pending_fds_out()) >= 0)
+        orig_sys_close(fd);
+}
+
+static long do_close_files(int close_type)
+{
+    long next_timeout;
+
     if (close_type == CLOSE_ALL)
-        shutdown_all_sock_list();
+        next_timeout = shutdown_all_sock_list();
     else 
-        shutdown_timeout_sock_list();
+        next_timeout = shutdown_timeout_sock_list();
 
-    while ((fd = connpd_close_pending_fds_out()) >= 0)
-        orig_sys_close(fd);
+    close_pending_files();
+
+    return next_timeout;
+}
+
+static inline unsigned long connpd_work_delay(int work)
+{
+    switch (work) {
+        case CONNPD_WORK_PRECONNECT:
+            return CONNPD_PRECONNECT_DELAY;
+        case CONNPD_WORK_STATS:
+            return DUMP_INTERVAL * HZ;
+        default:
+            return 0;
+    }
+}
+
+/**
+ *Wake up kconnpd if it is going to sleep, must be called after the work published.
+ */
+static inline void connpd_wake(void)
+{
+    struct task_struct *tsk;
+
+    smp_mb();
+
+    if (!connpd_sleeping || !xchg(&connpd_sleeping, 0))
+        return;
+
+    tsk = CONNP_DAEMON_TSKP;
+    if (tsk)
+        wake_up_process(tsk);
+}
+
+/**
+ *Mark the work pending, kconnpd is waked up only at the first time.
+ */
+void connpd_work_notify(int work)
+{
+    if (test_bit(work, &connpd_works) || test_and_set_bit(work, &connpd_works))
+        return;
+
+    connpd_works_jiffies[work] = jiffies;
+
+    if (!connpd_work_delay(work))
+        atomic64_cmpxchg(&connpd_works_stamp, 0, ktime_to_ns(ktime_get()));
+
+    connpd_wake();
+}
+
+void connpd_item_post(struct connpd_item_t *item)
+{
+    struct connpd_item_slot_t *slot;
+    unsigned int pos;
+    int dif;
+
+    pos = atomic_read(&connpd_items_tail);
+
+    for (;;) {
+        slot = &connpd_items[pos & CONNPD_ITEMS_MASK];
+        dif = (int)((unsigned int)atomic_read(&slot->seq) - pos);
+
+        if (!dif) {
+            if ((unsigned int)atomic_cmpxchg(&connpd_items_tail, pos, pos + 1) == pos)
+                break;
+        } else if (dif < 0) { //full
+            atomic_inc(&connpd_items_overflows);
+
+            if (item->type == CONNPD_ITEM_SERVER_CLOSE)
+                cfg_conn_observe_close(&item->servaddr, CONN_CLOSE_SERVER);
+
+            connpd_work_notify(CONNPD_WORK_SCAN); //the scan finds the marked socks.
+            return;
+        }
+
+        pos = atomic_read(&connpd_items_tail);
+    }
+
+    slot->item = *item;
+    smp_wmb();
+    atomic_set(&slot->seq, pos + 1);
+
+    connpd_wake();
+}
+
+static inline int connpd_items_pending(void)
+{
+    struct connpd_item_slot_t *slot = &connpd_items[connpd_items_head & CONNPD_ITEMS_MASK];
+
+    return (unsigned int)atomic_read(&slot->seq) == connpd_items_head + 1;
+}
+
+static int connpd_item_take(struct connpd_item_t *item)
+{
+    struct connpd_item_slot_t *slot = &connpd_items[connpd_items_head & CONNPD_ITEMS_MASK];
+
+    if ((unsigned int)atomic_read(&slot->seq) != connpd_items_head + 1)
+        return 0;
+
+    smp_rmb();
+    *item = slot->item;
+    smp_mb(); //read out before the slot is reused.
+
+    atomic_set(&slot->seq, connpd_items_head + CONNPD_ITEMS_SIZE);
+    connpd_items_head++;
+
+    return 1;
+}
+
+static void connpd_items_init(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < CONNPD_ITEMS_SIZE; i++)
+        atomic_set(&connpd_items[i].seq, i);
+
+    atomic_set(&connpd_items_tail, 0);
+    connpd_items_head = 0;
+}
+
+static inline void connpd_deadline_update(long timeout)
+{
+    unsigned long deadline;
+
+    if (timeout == MAX_SCHEDULE_TIMEOUT)
+        return;
+
+    deadline = jiffies + timeout;
+    if (!connpd_deadline_set || time_before(deadline, connpd_deadline)) {
+        connpd_deadline = deadline;
+        connpd_deadline_set = 1;
+    }
+}
+
+static inline long connpd_deadline_timeout(void)
+{
+    if (!connpd_deadline_set)
+        return MAX_SCHEDULE_TIMEOUT;
+
+    if (time_after_eq(jiffies, connpd_deadline))
+        return 0;
+
+    return connpd_deadline - jiffies;
+}
+
+/**
+ *Handle the posted items, the new socks are left to the full scan if any.
+ */
+static void connpd_items_handle(int rescan)
+{
+    struct connpd_item_t item;
+    long timeout;
+
+    while (connpd_item_take(&item)) {
+
+        connpd_wake_stats.items++;
+
+        switch (item.type) {
+            case CONNPD_ITEM_CLOSE_SOCK:
+                shutdown_sock(item.sb, item.gen);
+                break;
+            case CONNPD_ITEM_POLL_SOCK:
+                if (!rescan && (timeout = check_sock_in(item.sb, item.gen)) >= 0)
+                    connpd_deadline_update(timeout);
+                break;
+            case CONNPD_ITEM_SERVER_CLOSE:
+                cfg_conn_observe_close(&item.servaddr, CONN_CLOSE_SERVER);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+/**
+ *Returns the jiffies to the nearest due work, 0 if any is due.
+ */
+static long connpd_works_timeout(void)
+{
+    long timeout = MAX_SCHEDULE_TIMEOUT;
+    unsigned long now = jiffies;
+    int work;
+
+    for (work = 0; work < CONNPD_WORKS; work++) {
+        unsigned long due;
+
+        if (!test_bit(work, &connpd_works))
+            continue;
+
+        due = connpd_works_jiffies[work] + connpd_work_delay(work);
+        if (time_after_eq(now, due))
+            return 0;
+
+        if ((long)(due - now) < timeout)
+            timeout = due - now;
+    }
+
+    return timeout;
+}
+
+/**
+ *Sleep until an item posted, a work is due or the idle timeout, without any tick.
+ */
+static void connpd_wait_works(void)
+{
+    long timeout, idle_timeout;
+
+    for (;;) {
+
+        set_current_state(TASK_INTERRUPTIBLE);
+        connpd_sleeping = 1;
+        smp_mb();
+
+        if (kthread_should_stop() || connpd_items_pending())
+            break;
+
+        timeout = connpd_works_timeout();
+        idle_timeout = connpd_deadline_timeout();
+        if (idle_timeout < timeout)
+            timeout = idle_timeout;
+
+        if (!timeout)
+            break;
+
+        schedule_timeout(timeout);
+        connpd_wake_stats.wakeups++;
+    }
+
+    connpd_sleeping = 0;
+    __set_current_state(TASK_RUNNING);
+}
+
+/**
+ *Take the due works and account the wake-up latency, returns the works taken.
+ */
+static unsigned long connpd_works_take(void)
+{
+    unsigned long works = 0;
+    unsigned long now = jiffies;
+    s64 stamp, latency;
+    int work;
+
+    for (work = 0; work < CONNPD_WORKS; work++) {
+        if (!test_bit(work, &connpd_works))
+            continue;
+
+        if (time_before(now, connpd_works_jiffies[work] + connpd_work_delay(work)))
+            continue;
+
+        if (test_and_clear_bit(work, &connpd_works))
+            works |= 1UL << work;
+    }
+
+    connpd_wake_stats.rounds++;
+
+    stamp = atomic64_xchg(&connpd_works_stamp, 0);
+    if (!stamp)
+        return works;
 
+    latency = ktime_to_ns(ktime_get()) - stamp;
+    if (latency < 0)
+        return works;
+
+    connpd_wake_stats.latency_samples++;
+    connpd_wake_stats.latency_sum += latency;
+    if (latency > connpd_wake_stats.latency_max)
+        connpd_wake_stats.latency_max = latency;
+
+    return works;
 }
 
 static int connpd_do_poll(void *data, poll_table *pt)
@@ -102,44 +448,89 @@ static int connpd_do_poll(void *data, poll_table *pt)
     return mask;
 }
 
+#define CONNPD_POLLFD_VALID(pfdp)                       \
+    ({struct socket_bucket *__sb = (pfdp)->data;       \
+     __sb->sb_in_use && __sb->gen == (pfdp)->tag && !__sb->sock_close_now;})
+
 /**
- *Wait events or timeout.
+ *Build the poll set of the node, keeps the valid ones of the last round
+ *unless the check list is refilled by a full scan.
  */
-static void connp_wait_events_or_timout(void)
+static void connpd_pollfds_build(struct connpd_poller_t *poller)
 {
-    int nums;
-    struct socket_bucket **sb;
+    struct array_t *old = poller->pollfd_array;
+    struct pollfd_ex_t *pfdp;
     struct pollfd_ex_t pfdt;
-    struct array_t *pollfd_array;
-    int count = 0;
+    struct socket_bucket **sb;
+    int nid = poller->nid;
+    int nums = 0;
     int idx = 0;
-    int timeout = 1;//sec
+    int i;
 
-    nums = sockp_sbs_check_list->elements;
+    poller->pollfd_array = NULL;
 
-    if (!array_init(&pollfd_array, nums, sizeof(struct pollfd_ex_t)))
-        goto poll;
-    
-    while ((sb = (struct socket_bucket **)sockp_sbs_check_list_out())) {
+    if (old && poller->rebuild) {
+        old->destroy(&old);
+        old = NULL;
+    }
+
+    if (old)
+        for (i = 0; i < old->elements; i++) {
+            pfdp = (struct pollfd_ex_t *)old->get(old, i);
+            if (CONNPD_POLLFD_VALID(pfdp))
+                nums++;
+        }
+
+    nums += sockp_sbs_check_list(nid)->elements;
+
+    if (!array_init(&poller->pollfd_array, nums, sizeof(struct pollfd_ex_t)))
+        goto out;
+
+    if (old)
+        for (i = 0; i < old->elements; i++) {
+            pfdp = (struct pollfd_ex_t *)old->get(old, i);
+            if (CONNPD_POLLFD_VALID(pfdp))
+                poller->pollfd_array->set(poller->pollfd_array, pfdp, idx++);
+        }
+
+    while ((sb = (struct socket_bucket **)sockp_sbs_check_list_out(nid))) {
+
+        if (idx >= nums)
+            continue;
 
         pfdt.pollfd.fd = (*sb)->connpd_fd;
         pfdt.pollfd.events = POLLRDHUP;
         pfdt.pollfd.revents = 0;
         pfdt.data = (*sb);
         pfdt.poll_func = connpd_do_poll;
+        pfdt.tag = (*sb)->gen;
 
-        pollfd_array->set(pollfd_array, &pfdt, idx++);
+        poller->pollfd_array->set(poller->pollfd_array, &pfdt, idx++);
 
     }
 
-poll:
-    count = lkm_poll(pollfd_array, timeout);
+out:
+    if (old)
+        old->destroy(&old);
+}
 
-    if (!pollfd_array)
-        return;
+/**
+ *Wait events of the pool shard of the node or the abort of the round.
+ */
+static void connp_wait_events_or_timout(struct connpd_poller_t *poller)
+{
+    struct array_t *pollfd_array;
+    int count = 0;
+    int idx = 0;
+
+    connpd_pollfds_build(poller);
+
+    pollfd_array = poller->pollfd_array;
+
+    count = lkm_poll(pollfd_array, CONNPD_POLL_TIMEOUT, &poller->abort);
 
-    if (count <= 0)
-        goto out_free;
+    if (!pollfd_array || count <= 0)
+        return;
 
     {
         struct pollfd_ex_t *pfdp;
@@ -148,18 +539,210 @@ poll:
 
             pfdp = (struct pollfd_ex_t *)pollfd_array->get(pollfd_array, idx);
 
-            if (pfdp && (pfdp->pollfd.revents & (POLLRDHUP|E_EVENTS))) {
-                struct socket *sock;
+            //posted to connpd to close.
+            if (pfdp && (pfdp->pollfd.revents & (POLLRDHUP|E_EVENTS)))
+                set_sb_close_now((struct socket_bucket *)pfdp->data, pfdp->tag);
 
-                sock = ((struct socket_bucket *)pfdp->data)->sock;
-                set_sock_close_now(sock, 1);
-            }
+        }
+    }
+}
+
+static int connpd_poller_func(void *data)
+{
+    struct connpd_poller_t *poller = (struct connpd_poller_t *)data;
+    struct rlimit new_rlim = {NR_MAX_OPEN_FDS, NR_MAX_OPEN_FDS};
+    int round = 0;
+
+    lkm_setrlimit(RLIMIT_NOFILE, new_rlim);
+
+    for(;;) {
+
+        set_current_state(TASK_INTERRUPTIBLE);
+
+        if (kthread_should_stop()) {
+            __set_current_state(TASK_RUNNING);
+            break;
+        }
 
+        if (round == poller->round) { //wait for the next round.
+            schedule();
+            continue;
         }
+
+        __set_current_state(TASK_RUNNING);
+
+        round = poller->round;
+        smp_rmb();
+
+        spare_conns_preconnect_on_node(poller->nid);
+
+        if (!poller->abort)
+            connp_wait_events_or_timout(poller);
+
+        if (atomic_dec_and_test(&connpd_pollers_busy))
+            wake_up(&connpd_pollers_wq);
+
     }
 
-out_free:
-    pollfd_array->destroy(&pollfd_array);
+    return 1;
+}
+
+/**
+ *Start a round of all pollers, rebuild: the check lists are refilled by a full scan.
+ */
+static void connpd_pollers_run(int rebuild)
+{
+    struct connpd_poller_t *poller;
+    int nid;
+
+    for_each_node_mask(nid, sockp_nodes) {
+        poller = &connpd_pollers[nid];
+        if (!poller->tsk)
+            continue;
+
+        poller->abort = 0;
+        poller->rebuild = rebuild;
+        atomic_inc(&connpd_pollers_busy);
+        smp_wmb();
+        poller->round++;
+
+        wake_up_process(poller->tsk);
+    }
+}
+
+/**
+ *Stop the polling of all pollers and wait for the end of the round.
+ */
+static void connpd_pollers_sync(void)
+{
+    struct connpd_poller_t *poller;
+    int nid;
+
+    for_each_node_mask(nid, sockp_nodes) {
+        poller = &connpd_pollers[nid];
+        if (!poller->tsk)
+            continue;
+
+        poller->abort = 1;
+        smp_mb();
+        wake_up_process(poller->tsk);
+    }
+
+    wait_event(connpd_pollers_wq, !atomic_read(&connpd_pollers_busy));
+}
+
+static int connpd_pollers_start(void)
+{
+    struct connpd_poller_t *poller;
+    struct task_struct *ptr;
+    int nid;
+
+    for_each_node_mask(nid, sockp_nodes) {
+        poller = &connpd_pollers[nid];
+
+        memset(poller, 0, sizeof(struct connpd_poller_t));
+        poller->nid = nid;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 2, 0)
+        ptr = kthread_create_on_node(connpd_poller_func, poller, nid, CONNPD_POLLER_NAME, nid);
+#else
+        ptr = kthread_create(connpd_poller_func, poller, CONNPD_POLLER_NAME, nid);
+#endif
+        if (IS_ERR(ptr)) {
+            printk(KERN_ERR "Create connpd poller of node %d error!", nid);
+            connpd_pollers_stop();
+            return 0;
+        }
+
+        set_cpus_allowed_ptr(ptr, cpumask_of_node(nid));
+
+        poller->tsk = ptr;
+        wake_up_process(ptr);
+    }
+
+    return 1;
+}
+
+static void connpd_pollers_stop(void)
+{
+    struct connpd_poller_t *poller;
+    int nid;
+
+    for_each_node_mask(nid, sockp_nodes) {
+        poller = &connpd_pollers[nid];
+        if (!poller->tsk)
+            continue;
+
+        kthread_stop(poller->tsk);
+        poller->tsk = NULL;
+
+        if (poller->pollfd_array)
+            poller->pollfd_array->destroy(&poller->pollfd_array);
+    }
+}
+
+#define CONNPD_STATS_WAKEUPS_LINE_MAX 256
+#define CONNPD_STATS_THREAD_LINE_MAX 80
+
+/**
+ *The room kept in the stats page for the thread lines, the connpd and the node pollers.
+ */
+int connpd_stats_info_reserve(void)
+{
+    return MIN(CONNPD_STATS_WAKEUPS_LINE_MAX 
+            + CONNPD_STATS_THREAD_LINE_MAX * (1 + nodes_weight(sockp_nodes)), PAGE_SIZE / 2);
+}
+
+/**
+ *Sprint the cpu time of the connpd threads.
+ */
+int connpd_stats_info_sprint(char *buf, int size)
+{
+    const char *thread_stat_str_fmt = "Thread: %s, Node: %d, CPU: %llu ms\n";
+    struct connpd_poller_t *poller;
+    char name[TASK_COMM_LEN];
+    int offset = 0;
+    int nid, l;
+
+    if (CONNP_DAEMON_TSKP) {
+        l = snprintf(buf, size, thread_stat_str_fmt, 
+                CONNPD_NAME, -1,
+                (unsigned long long)div_u64(CONNP_DAEMON_TSKP->se.sum_exec_runtime, NSEC_PER_MSEC));
+        if (l >= size)
+            return 0;
+        offset += l;
+
+        l = snprintf(buf + offset, size - offset, 
+                "Wakeups: %lu, Rounds: %lu, Rescans: %lu, Items: %lu, Overflows: %d, "
+                "Latency: avg %llu us, max %llu us\n",
+                connpd_wake_stats.wakeups, connpd_wake_stats.rounds,
+                connpd_wake_stats.rescans, connpd_wake_stats.items,
+                atomic_read(&connpd_items_overflows),
+                (unsigned long long)div_u64(connpd_wake_stats.latency_samples 
+                    ? div64_u64(connpd_wake_stats.latency_sum, connpd_wake_stats.latency_samples) : 0, 
+                    NSEC_PER_USEC),
+                (unsigned long long)div_u64(connpd_wake_stats.latency_max, NSEC_PER_USEC));
+        if (l >= size - offset)
+            return offset;
+        offset += l;
+    }
+
+    for_each_node_mask(nid, sockp_nodes) {
+        poller = &connpd_pollers[nid];
+        if (!poller->tsk)
+            continue;
+
+        snprintf(name, sizeof(name), CONNPD_POLLER_NAME, nid);
+
+        l = snprintf(buf + offset, size - offset, thread_stat_str_fmt, 
+                name, nid,
+                (unsigned long long)div_u64(poller->tsk->se.sum_exec_runtime, NSEC_PER_MSEC));
+        if (l >= size - offset)
+            break;
+        offset += l;
+    }
+
+    return offset;
 }
 
 static int connpd_func(void *data)
@@ -167,13 +750,19 @@ static int connpd_func(void *data)
     struct rlimit new_rlim = {NR_MAX_OPEN_FDS, NR_MAX_OPEN_FDS};
 
     lkm_setrlimit(RLIMIT_NOFILE, new_rlim);
-    
-    allow_signal(NOTIFY_SIG);
+
+    //Full scan at the first round.
+    connpd_deadline = jiffies;
+    connpd_deadline_set = 1;
 
     for(;;) {
 
+        int rescan;
+
         if (kthread_should_stop()) {
 
+            connpd_pollers_stop();
+
             connp_wlock();
            
             connpd_unused_fds_put(); 
@@ -186,16 +775,34 @@ static int connpd_func(void *data)
             break;
 
         } else {
-            //Scan and shutdown
-            close_timeout_files();
+            //The works and the idle timeout need a full scan, the items not.
+            rescan = connpd_works_take() || !connpd_deadline_timeout();
+
+            connpd_items_handle(rescan);
+
+            if (rescan) {
+                connpd_wake_stats.rescans++;
+
+                //Scan and shutdown
+                connpd_deadline_set = 0;
+                connpd_deadline_update(close_timeout_files());
+            } else
+                close_pending_files();
 
             connpd_unused_fds_prefetch();
-            
-            scan_spare_conns_preconnect(); 
-            
-            conn_stats_info_dump();
 
-            connp_wait_events_or_timout();
+            if (rescan) {
+                scan_spare_conns_preconnect(); 
+
+                conn_stats_info_dump();
+            }
+
+            connpd_pollers_run(rescan);
+
+            //Wait the works and the items from the pollers or the hooks.
+            connpd_wait_works();
+
+            connpd_pollers_sync();
 
         }
 
@@ -231,6 +838,8 @@ static void connpd_stop(void)
 
 int connpd_init()
 {   
+    connpd_items_init();
+
     if (!connpd_close_pending_fds_init(NR_MAX_OPEN_FDS))
         return 0;
 
@@ -239,8 +848,18 @@ int connpd_init()
         return 0;
     }
 
-    if (!connpd_start())
+    if (!connpd_pollers_start()) {
+        connpd_unused_fds_destroy();
+        connpd_close_pending_fds_destroy();
+        return 0;
+    }
+
+    if (!connpd_start()) {
+        connpd_pollers_stop();
+        connpd_unused_fds_destroy();
+        connpd_close_pending_fds_destroy();
         return 0;
+    }
  
     return 1;
 }
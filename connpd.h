@@ -18,6 +18,59 @@ extern struct task_struct * volatile connp_daemon;
 extern int connpd_init(void);
 extern void connpd_destroy(void);
 
+extern int connpd_stats_info_sprint(char *buf, int size);
+extern int connpd_stats_info_reserve(void);
+
+/*The works of kconnpd, it sleeps until a work is due or the nearest idle timeout*/
+#define CONNPD_WORK_CLOSE       0 //socks to close
+#define CONNPD_WORK_SCAN        1 //new socks to poll
+#define CONNPD_WORK_PRECONNECT  2 //spare conns consumed
+#define CONNPD_WORK_STATS       3 //stats changed
+#define CONNPD_WORKS            4
+
+extern void connpd_work_notify(int work);
+
+/*The work items to kconnpd, posted lockless by the hooks and the pollers*/
+typedef enum {
+    CONNPD_ITEM_CLOSE_SOCK = 1, //the bucket is marked to close
+    CONNPD_ITEM_POLL_SOCK, //the bucket is inserted
+    CONNPD_ITEM_SERVER_CLOSE //a conn of the iport closed by the server
+} connpd_item_type_t;
+
+struct socket_bucket;
+
+struct connpd_item_t {
+    connpd_item_type_t type;
+    struct socket_bucket *sb;
+    unsigned int gen; //generation of the bucket when posted
+    struct sockaddr servaddr;
+};
+
+/**
+ *Post the item to kconnpd, a full scan is queued instead if the queue overflows.
+ */
+extern void connpd_item_post(struct connpd_item_t *item);
+
+#define connpd_sock_item_post(item_type, bucket)    \
+    do {                                            \
+        struct connpd_item_t __item = {             \
+            .type = (item_type),                    \
+            .sb = (bucket),                         \
+            .gen = (bucket)->gen,                   \
+        };                                          \
+        connpd_item_post(&__item);                  \
+    } while (0)
+
+#define connpd_close_sock_notify(sb) connpd_sock_item_post(CONNPD_ITEM_CLOSE_SOCK, sb)
+#define connpd_poll_sock_notify(sb) connpd_sock_item_post(CONNPD_ITEM_POLL_SOCK, sb)
+
+#define connpd_server_close_notify(addr)                                \
+    do {                                                                \
+        struct connpd_item_t __item = {.type = CONNPD_ITEM_SERVER_CLOSE};  \
+        memcpy(&__item.servaddr, (addr), sizeof(struct sockaddr));      \
+        connpd_item_post(&__item);                                      \
+    } while (0)
+
 extern struct stack_t *connpd_close_pending_fds, 
                       *connpd_unused_fds;
 
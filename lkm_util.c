@@ -209,13 +209,13 @@ static void __pollwait(struct file *filp,
     add_wait_queue(wait_address, &entry->wait);
 }
 
-int lkm_poll(array_t *pfdt_list, int timeo)
+int lkm_poll(array_t *pfdt_list, long timeo, volatile int *abort)
 {
     struct poll_wqueues_alias table;
     poll_table *pt;
     int count = 0;
     int timed_out = 0;
-    long __timeout = timeo * HZ;
+    long __timeout = timeo;
 
     lkm_poll_initwait(&table);
     pt = &(&table)->pt;
@@ -252,13 +252,21 @@ ignore_poll:
             if (signal_pending(current)) {
                 count = -EINTR;
                 flush_signals(current);
-            }
+            } else if (abort && *abort)
+                count = -EINTR;
         }
 
         if (count || timed_out)
             break;
 
-        __timeout = wait_for_sig_or_timeout(__timeout);
+        //The wakers set the flags before the wake up, check them after the state set.
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (!table.triggered && !(abort && *abort))
+            __timeout = schedule_timeout(__timeout);
+        __set_current_state(TASK_RUNNING);
+        table.triggered = 0;
+        smp_mb();
+
         if (!__timeout)
             timed_out = 1;
     }
@@ -288,8 +296,48 @@ static int sock_map_fd(struct socket *sock, int flags)
     put_unused_fd(fd);
     return PTR_ERR(newfile);
 }
+
+/**
+ *Allocate the file of the sock, the sock is released on failure.
+ */
+struct file *lkm_sock_alloc_file(struct socket *sock)
+{
+    struct file *file;
+
+    file = sock_alloc_file(sock, 0, NULL);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 16, 0)
+    if (IS_ERR(file))
+        sock_release(sock);
+#endif
+
+    return file;
+}
 #endif
 
+const struct file_operations *lkm_socket_file_ops;
+
+/**
+ *Get the file ops of the sockfs, which is not exported.
+ */
+void lkm_socket_file_ops_init(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 7, 10)
+    struct socket *sock;
+    struct file *file;
+
+    if (sock_create_lite(AF_INET, SOCK_STREAM, IPPROTO_TCP, &sock) < 0)
+        return;
+
+    file = lkm_sock_alloc_file(sock);
+    if (IS_ERR(file))
+        return;
+
+    lkm_socket_file_ops = file->f_op;
+
+    fput(file); //release the sock too.
+#endif
+}
+
 int lkm_create_tcp_connect(struct sockaddr_in *address)
 {
     int fd;
@@ -14,6 +14,7 @@
 #include <linux/sched.h>
 #include <net/sock.h>
 #include <linux/tcp.h>
+#include <net/tcp.h>
 #include <net/inet_sock.h>
 #include <net/flow.h>
 #include <net/route.h>
@@ -29,6 +30,8 @@
 #include <linux/list.h>
 #include <linux/poll.h>
 #include <linux/jiffies.h>
+#include <linux/random.h>
+#include <linux/jhash.h>
 #include <asm/tlbflush.h>
 
 #define wait_for_sig_or_timeout(timeout) schedule_timeout_interruptible(timeout)
@@ -38,6 +41,7 @@ struct pollfd_ex_t {
     struct pollfd pollfd;
     void *data;
     int (*poll_func)(void *data, poll_table *pt);
+    unsigned int tag; //caller's tag of the data
 };
 
 #define MIN(arg1, arg2) (arg1 < arg2 ? arg1 : arg2)
@@ -47,10 +51,6 @@ struct pollfd_ex_t {
 
 #define NOW_SECS (CURRENT_TIME_SEC.tv_sec)
 
-#define NOTIFY_SIG (SIGINT)
-#define SEND_FORCE (1)
-#define notify(tskp) send_sig(NOTIFY_SIG, (tskp), SEND_FORCE)
-
 #define INVOKED_BY_TGROUP_LEADER() (current == current->group_leader)
 
 #define lkmalloc(size) kzalloc(size, GFP_ATOMIC)
@@ -63,6 +63,9 @@ struct pollfd_ex_t {
 #define IS_CLIENT_SOCK(sock)                    \
     ((sock)->file && ((sock)->file->f_flags & SOCK_CLIENT_TAG))
 
+#define IS_CLIENT_FILE(filp)                    \
+    ((filp)->f_flags & SOCK_CLIENT_TAG)
+
 #define SET_CLIENT_FLAG(sock) do {              \
     if ((sock)->file)                           \
     (sock)->file->f_flags |= SOCK_CLIENT_TAG;   \
@@ -73,12 +76,40 @@ struct pollfd_ex_t {
     (sock)->file->f_flags &= ~SOCK_CLIENT_TAG;  \
 } while (0)
 
+#define SOCK_ACTIVE_TAG (1U << 29) //counted in the active conns of the iport
+
+#define IS_ACTIVE_SOCK(sock)                    \
+    ((sock)->file && ((sock)->file->f_flags & SOCK_ACTIVE_TAG))
+
+#define SET_ACTIVE_FLAG(sock) do {              \
+    if ((sock)->file)                           \
+    (sock)->file->f_flags |= SOCK_ACTIVE_TAG;   \
+} while (0)
+
+#define CLEAR_ACTIVE_FLAG(sock) do {            \
+    if ((sock)->file)                           \
+    (sock)->file->f_flags &= ~SOCK_ACTIVE_TAG;  \
+} while (0)
+
+#define SOCK_OBSERVED_TAG (1U << 28) //the close evidence is recorded
+
+#define IS_OBSERVED_SOCK(sock)                  \
+    ((sock)->file && ((sock)->file->f_flags & SOCK_OBSERVED_TAG))
+
+#define SET_OBSERVED_FLAG(sock) do {            \
+    if ((sock)->file)                           \
+    (sock)->file->f_flags |= SOCK_OBSERVED_TAG; \
+} while (0)
+
 #define SK_ESTABLISHING(sk) \
     (sk->sk_state == TCP_SYN_SENT)
 
 #define SK_ESTABLISHED(sk)  \
     (sk->sk_state == TCP_ESTABLISHED)
 
+#define SK_PEER_CLOSED(sk)  \
+    ((sk)->sk_shutdown & RCV_SHUTDOWN || (sk)->sk_err || (sk)->sk_state != TCP_ESTABLISHED)
+
 #define SET_SOCK_STATE(sock, STATE)    \
     ((sock)->state = STATE)
 
@@ -88,6 +119,9 @@ struct pollfd_ex_t {
 #define IS_TCP_SOCK(sock) \
     ((sock)->type == SOCK_STREAM)
 
+#define IS_TCP_SK(sk) \
+    ((sk)->sk_family == AF_INET && (sk)->sk_protocol == IPPROTO_TCP)
+
 #define IS_UNCONNECTED_SOCK(sock) \
     ((sock)->type == SS_UNCONNECTED)
 
@@ -166,15 +200,247 @@ typedef atomic64_t lkm_atomic_t;
     } while (0)
 
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 33)
+#define SK_DADDR(sk) (inet_sk(sk)->daddr)
+#define SK_DPORT(sk) (inet_sk(sk)->dport)
+#else
+#define SK_DADDR(sk) (inet_sk(sk)->inet_daddr)
+#define SK_DPORT(sk) (inet_sk(sk)->inet_dport)
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 0, 0)
+#define SK_HAS_IP_OPTS(sk) (rcu_access_pointer(inet_sk(sk)->inet_opt) != NULL)
+#else
+#define SK_HAS_IP_OPTS(sk) (inet_sk(sk)->opt != NULL)
+#endif
+
 #define SOCKADDR_FAMILY(sockaddr_ptr) (((struct sockaddr_in *)(sockaddr_ptr)))->sin_family
 #define SOCKADDR_IP(sockaddr_ptr) (((struct sockaddr_in *)(sockaddr_ptr)))->sin_addr.s_addr
 #define SOCKADDR_PORT(sockaddr_ptr) (((struct sockaddr_in *)(sockaddr_ptr)))->sin_port
 
 typedef struct array_t array_t;
-extern int lkm_poll(array_t *, int timeout);
+extern int lkm_poll(array_t *, long timeout, volatile int *abort); //timeout in jiffies, abort: stop flag or NULL
 
 #define lkm_jiffies (unsigned)jiffies
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+#define lkm_random32() get_random_u32()
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(3, 8, 0)
+#define lkm_random32() prandom_u32()
+#else
+#define lkm_random32() random32()
+#endif
+
+/*The tcp keepalive options of a sock, the times in jiffies, 0 for the sysctl defaults*/
+struct lkm_keepalive_t {
+    unsigned char on; /*SO_KEEPALIVE*/
+    unsigned char probes; /*TCP_KEEPCNT*/
+    unsigned int time; /*TCP_KEEPIDLE*/
+    unsigned int intvl; /*TCP_KEEPINTVL*/
+};
+
+static inline void lkm_sk_keepalive_get(struct sock *sk, struct lkm_keepalive_t *ka)
+{
+    struct tcp_sock *tp = tcp_sk(sk);
+
+    ka->on = sock_flag(sk, SOCK_KEEPOPEN) ? 1 : 0;
+    ka->probes = tp->keepalive_probes;
+    ka->time = tp->keepalive_time;
+    ka->intvl = tp->keepalive_intvl;
+}
+
+/**
+ *Set the keepalive options as the setsockopt does, but without sleeping.
+ *The sock owned by the user is left alone.
+ *
+ *Returns:
+ *1: set, 0: skipped.
+ */
+static inline int lkm_sk_keepalive_set(struct sock *sk, struct lkm_keepalive_t *ka)
+{
+    struct tcp_sock *tp = tcp_sk(sk);
+    int ret = 0;
+
+    local_bh_disable();
+    bh_lock_sock(sk);
+
+    if (sock_owned_by_user(sk))
+        goto unlock_ret;
+
+    tp->keepalive_probes = ka->probes;
+    tp->keepalive_time = ka->time;
+    tp->keepalive_intvl = ka->intvl;
+
+    if (ka->on && sock_flag(sk, SOCK_KEEPOPEN)) {
+        //Rearm the running timer with the new idle time.
+        if (!((1 << sk->sk_state) & (TCPF_CLOSE | TCPF_LISTEN)))
+            inet_csk_reset_keepalive_timer(sk, keepalive_time_when(tp));
+    } else if (ka->on != (sock_flag(sk, SOCK_KEEPOPEN) ? 1 : 0)) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+        if (sk->sk_prot->keepalive)
+            sk->sk_prot->keepalive(sk, ka->on);
+#else
+        tcp_set_keepalive(sk, ka->on);
+#endif
+
+        if (ka->on)
+            sock_set_flag(sk, SOCK_KEEPOPEN);
+        else
+            sock_reset_flag(sk, SOCK_KEEPOPEN);
+    }
+
+    ret = 1;
+
+unlock_ret:
+    bh_unlock_sock(sk);
+    local_bh_enable();
+
+    return ret;
+}
+
+#define LKM_SOCKOPTS_BUF_LOCKS (SOCK_SNDBUF_LOCK | SOCK_RCVBUF_LOCK)
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 37)
+#define SK_USER_TIMEOUT(sk) (inet_csk(sk)->icsk_user_timeout)
+#else
+#define SK_USER_TIMEOUT(sk) 0 //no TCP_USER_TIMEOUT
+#endif
+
+/*The options the applications set on the client sock*/
+struct lkm_sockopts_t {
+    unsigned char nodelay; /*TCP_NODELAY*/
+    unsigned char userlocks; /*SO_SNDBUF and SO_RCVBUF set by the user*/
+    int sndbuf;
+    int rcvbuf;
+    u32 priority; /*SO_PRIORITY*/
+    unsigned int user_timeout; /*TCP_USER_TIMEOUT in jiffies*/
+};
+
+static inline void lkm_sk_sockopts_get(struct sock *sk, struct lkm_sockopts_t *opts)
+{
+    opts->nodelay = (tcp_sk(sk)->nonagle & TCP_NAGLE_OFF) ? 1 : 0;
+    opts->userlocks = sk->sk_userlocks & LKM_SOCKOPTS_BUF_LOCKS;
+    opts->sndbuf = sk->sk_sndbuf;
+    opts->rcvbuf = sk->sk_rcvbuf;
+    opts->priority = sk->sk_priority;
+    opts->user_timeout = SK_USER_TIMEOUT(sk);
+}
+
+/**
+ *Set the options as the setsockopt does, but without sleeping.
+ *The buffer sizes are only set if locked by the user, otherwise left to the autotuning.
+ *The sock owned by the user is left alone.
+ *
+ *Returns:
+ *1: set, 0: skipped.
+ */
+static inline int lkm_sk_sockopts_set(struct sock *sk, struct lkm_sockopts_t *opts)
+{
+    struct tcp_sock *tp = tcp_sk(sk);
+    int ret = 0;
+
+    local_bh_disable();
+    bh_lock_sock(sk);
+
+    if (sock_owned_by_user(sk))
+        goto unlock_ret;
+
+    if (opts->nodelay)
+        tp->nonagle |= TCP_NAGLE_OFF | TCP_NAGLE_PUSH;
+    else
+        tp->nonagle &= ~TCP_NAGLE_OFF;
+
+    sk->sk_userlocks = (sk->sk_userlocks & ~LKM_SOCKOPTS_BUF_LOCKS) | opts->userlocks;
+
+    if (opts->userlocks & SOCK_SNDBUF_LOCK)
+        sk->sk_sndbuf = opts->sndbuf;
+
+    if (opts->userlocks & SOCK_RCVBUF_LOCK)
+        sk->sk_rcvbuf = opts->rcvbuf;
+
+    sk->sk_priority = opts->priority;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 37)
+    SK_USER_TIMEOUT(sk) = opts->user_timeout;
+#endif
+
+    ret = 1;
+
+unlock_ret:
+    bh_unlock_sock(sk);
+    local_bh_enable();
+
+    return ret;
+}
+
+/**
+ *Fingerprint of the routing options of the sock: SO_MARK, SO_BINDTODEVICE and IP_TOS.
+ *The options of the lkm_sockopts_t template are left out, they are normalized in the pool.
+ *
+ *Returns:
+ *0 for the default options, the hash otherwise.
+ */
+static inline u32 lkm_sk_fingerprint(struct sock *sk)
+{
+    u32 v[3];
+    u32 fp;
+
+    if (!sk)
+        return 0;
+
+    v[0] = sk->sk_mark;
+    v[1] = sk->sk_bound_dev_if;
+    v[2] = inet_sk(sk)->tos;
+
+    if (!(v[0] | v[1] | v[2]))
+        return 0;
+
+    fp = jhash2(v, ARRAY_SIZE(v), 0);
+
+    return fp ? fp : 1;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
+#define LKM_TCP_JIFFIES32 tcp_jiffies32
+#else
+#define LKM_TCP_JIFFIES32 tcp_time_stamp
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 15, 0)
+#define SK_SRTT_US(sk) (tcp_sk(sk)->srtt_us >> 3)
+#else
+#define SK_SRTT_US(sk) jiffies_to_usecs(tcp_sk(sk)->srtt >> 3)
+#endif
+
+#define SK_SND_CWND(sk) (tcp_sk(sk)->snd_cwnd)
+
+/**
+ *Make the idle sock look busy to the cwnd restart and validation on the next send,
+ *it keeps the cwnd learned before the idle.
+ *
+ *Returns:
+ *1: the slow start restart was due and skipped, 0: otherwise.
+ */
+static inline int lkm_sk_cwnd_keep(struct sock *sk)
+{
+    struct tcp_sock *tp = tcp_sk(sk);
+    int due = 0;
+
+    local_bh_disable();
+    bh_lock_sock(sk);
+
+    if (!sock_owned_by_user(sk) && !tp->packets_out) {
+        due = (s32)(LKM_TCP_JIFFIES32 - tp->lsndtime) > (s32)inet_csk(sk)->icsk_rto;
+        tp->lsndtime = LKM_TCP_JIFFIES32;
+        tp->snd_cwnd_stamp = LKM_TCP_JIFFIES32;
+    }
+
+    bh_unlock_sock(sk);
+    local_bh_enable();
+
+    return due;
+}
+
 //Compat for 32-bits jiffies
 static inline u64 lkm_jiffies_elapsed_from(u64 from)
 {
@@ -203,11 +469,6 @@ static inline void file_count_set(struct file *filp, int c)
     lkm_atomic32_set(&filp->f_count, c);
 }
 
-struct fd_entry {
-    int fd;
-    struct list_head siblings;
-};
-
 static inline int lkm_get_unused_fd(void)
 {
     int fd;
@@ -226,9 +487,14 @@ extern int lkm_create_tcp_connect(struct sockaddr_in *);
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 7, 10)
 extern int lkm_sock_map_fd(struct socket *sock, int flags);
+extern struct file *lkm_sock_alloc_file(struct socket *sock);
 #endif
 
-static inline void TASK_GET_FDS(struct task_struct *tsk, struct list_head *fds_list)
+/**
+ *Walk the open fds of the task without any allocation.
+ */
+static inline void TASK_FDS_FOR_EACH_CALL(struct task_struct *tsk, 
+        void (*call_func)(int fd, void *data), void *data)
 {
     int i, j = 0;
     FILE_FDT_TYPE *fdt;
@@ -237,7 +503,6 @@ static inline void TASK_GET_FDS(struct task_struct *tsk, struct list_head *fds_l
     
     for (;;) {
         unsigned long set;
-        struct fd_entry *tmp;
 
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(3, 2, 45)
         i = j * __NFDBITS;
@@ -256,12 +521,9 @@ static inline void TASK_GET_FDS(struct task_struct *tsk, struct list_head *fds_l
 
         while (set) {
 
-            if (set & 1) {
-                /*Collect the fds list and must free mem space by caller.*/
-                tmp = (typeof(*tmp) *)lkmalloc(sizeof(typeof(*tmp)));
-                tmp->fd = i;
-                list_add_tail(&tmp->siblings, fds_list);
-            }
+            if (set & 1)
+                call_func(i, data);
+
             i++;
             set >>= 1;
 
@@ -445,6 +707,26 @@ static inline int is_sock_fd(int fd)
     return S_ISSOCK(statbuf.mode);
 }
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 20)
+#define FILE_DENTRY(filp) ((filp)->f_dentry)
+#else
+#define FILE_DENTRY(filp) ((filp)->f_path.dentry)
+#endif
+
+extern const struct file_operations *lkm_socket_file_ops;
+extern void lkm_socket_file_ops_init(void);
+
+/**
+ *Check the socket file by the file ops without the stat.
+ */
+static inline int is_sock_file(struct file *filp)
+{
+    if (lkm_socket_file_ops)
+        return filp->f_op == lkm_socket_file_ops;
+
+    return S_ISSOCK(FILE_DENTRY(filp)->d_inode->i_mode);
+}
+
 static inline void sock_destroy(struct sock *sk)
 {
     sock_orphan(sk);
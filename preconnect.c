@@ -5,6 +5,7 @@
 #include "lkm_util.h"
 #include "sys_call.h"
 #include "connp.h"
+#include "connpd.h"
 
 /*
  *Scan cfg entries to find the spare conns.
@@ -14,10 +15,65 @@
  */
 
 static void do_preconnect(void *data);
+static void do_node_preconnect(void *data, void *arg);
 static void conn_init_count(void *data);
 
+static void do_hot_preconnect(struct conn_node_t *conn_node);
 static void do_create_connects(struct sockaddr_in *, int nums);
 
+/*The spare conns of the groups, summed before the scan*/
+struct conn_group_spare_t {
+    unsigned int members;
+    unsigned int idle_count;
+    unsigned int max_idle_count; /*of the members*/
+};
+
+static struct conn_group_spare_t conn_group_spares[CONN_GROUPS_MAX + 1];
+
+static void conn_group_spare_sum(void *data)
+{
+    struct conn_node_t *conn_node;
+    struct conn_group_spare_t *spare;
+
+    conn_node = (typeof(conn_node))data;
+
+    if (!conn_node->conn_params.group
+            || conn_node->conn_ip == 0 || conn_node->conn_port == 0)
+        return;
+
+    spare = &conn_group_spares[conn_node->conn_params.group];
+    spare->members++;
+    spare->idle_count += conn_node->conn_idle_count;
+    if (conn_node->conn_idle_count > spare->max_idle_count)
+        spare->max_idle_count = conn_node->conn_idle_count;
+}
+
+/**
+ *The spare conns of the group are kept as a whole, the members share the shortage.
+ */
+static int conn_group_preconnect_nums(struct conn_node_t *conn_node)
+{
+    struct conn_group_spare_t *spare;
+
+    spare = &conn_group_spares[conn_node->conn_params.group];
+
+    //Close one conn of the member with the most spare ones.
+    if (spare->idle_count > conn_node->conn_params.group_max_spare) {
+        if (conn_node->conn_idle_count
+                && conn_node->conn_idle_count == spare->max_idle_count) {
+            conn_node->conn_close_now = 1;
+            connpd_work_notify(CONNPD_WORK_CLOSE);
+        }
+        return 0;
+    }
+
+    if (spare->idle_count >= conn_node->conn_params.group_min_spare)
+        return 0;
+
+    return DIV_ROUND_UP(conn_node->conn_params.group_min_spare - spare->idle_count, 
+            spare->members);
+}
+
 static void conn_init_count(void *data)
 {
     struct conn_node_t *conn_node;
@@ -30,34 +86,86 @@ static void conn_init_count(void *data)
 static void do_preconnect(void *data)
 {
     struct conn_node_t *conn_node;
-    struct sockaddr_in address;
     unsigned int idle_count;
     int preconnect_nums;
 
     conn_node = (typeof(conn_node))data;
 
-    if (conn_node->conn_ip == 0 || conn_node->conn_port == 0)
+    //The wildcard entry preconnects its hot destinations.
+    if (conn_node->conn_ip == 0 || conn_node->conn_port == 0) {
+        lkm_atomic_set(&conn_node->conn_preconnect_nums, 
+                cfg_conn_hot_preconnect(conn_node, MIN_SPARE_CONNECTIONS));
         return;
+    }
 
     idle_count = conn_node->conn_idle_count;    
- 
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = conn_node->conn_ip;
-    address.sin_port = conn_node->conn_port;
+
+    if (conn_node->conn_params.group) {
+        preconnect_nums = conn_group_preconnect_nums(conn_node);
+        goto breaker;
+    }
 
     //set close flag for one group conns.
     if (idle_count > MAX_SPARE_CONNECTIONS) {
         conn_node->conn_close_now = 1;
+        connpd_work_notify(CONNPD_WORK_CLOSE);
         return;
     }
     
-    //do preconnect
+    //preconnect by the connpd thread of the consumers node.
     preconnect_nums = MIN_SPARE_CONNECTIONS - idle_count;
-    do_create_connects(&address, preconnect_nums);
+
+breaker:
+    //No hammering on the broken server, only the half-open probe.
+    preconnect_nums = cfg_conn_breaker_preconnect(conn_node, 
+            preconnect_nums > 0 ? preconnect_nums : 0);
+    lkm_atomic_set(&conn_node->conn_preconnect_nums, preconnect_nums);
 
     return;
 }
 
+static void do_node_preconnect(void *data, void *arg)
+{
+    struct conn_node_t *conn_node;
+    struct sockaddr_in address;
+    int nid = *(int *)arg;
+    int preconnect_nums;
+
+    conn_node = (typeof(conn_node))data;
+
+    if (SOCKP_NODE(conn_node->conn_preferred_node) != nid)
+        return;
+
+    preconnect_nums = lkm_atomic_read(&conn_node->conn_preconnect_nums);
+    if (preconnect_nums <= 0)
+        return;
+
+    lkm_atomic_set(&conn_node->conn_preconnect_nums, 0);
+
+    if (conn_node->conn_ip == 0 || conn_node->conn_port == 0) {
+        do_hot_preconnect(conn_node);
+        return;
+    }
+
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = conn_node->conn_ip;
+    address.sin_port = conn_node->conn_port;
+
+    do_create_connects(&address, preconnect_nums);
+}
+
+static void do_hot_preconnect(struct conn_node_t *conn_node)
+{
+    struct sockaddr_in addrs[CONN_HOT_SLOTS];
+    int nums[CONN_HOT_SLOTS];
+    int i, n;
+
+    n = cfg_conn_hot_preconnect_take(conn_node, addrs, nums);
+
+    for (i = 0; i < n; i++)
+        do_create_connects(&addrs[i], nums[i]);
+}
+
 static void do_create_connects(struct sockaddr_in *servaddr, int nums)
 {
     int fd;
@@ -92,6 +200,14 @@ static void do_create_connects(struct sockaddr_in *servaddr, int nums)
 
 void scan_spare_conns_preconnect()
 {
+    memset(conn_group_spares, 0, sizeof(conn_group_spares));
+    cfg_allowed_entries_for_each_call(conn_group_spare_sum);
+
     cfg_allowed_entries_for_each_call(do_preconnect);
     cfg_allowed_entries_for_each_call(conn_init_count);
 }
+
+void spare_conns_preconnect_on_node(int nid)
+{
+    cfg_allowed_entries_for_each_call_arg(do_node_preconnect, &nid);
+}
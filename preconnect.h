@@ -6,6 +6,10 @@
 #define MIN_SPARE_CONNECTIONS GN("min_spare_connections_per_iport")
 #define MAX_SPARE_CONNECTIONS GN("max_spare_connections_per_iport")
 
+/*Count the spare conns of all iports, called by kconnpd*/
 extern void scan_spare_conns_preconnect(void);
 
+/*Create the spare conns of the iports consumed on the node, called by the node connpd thread*/
+extern void spare_conns_preconnect_on_node(int nid);
+
 #endif
@@ -0,0 +1,127 @@
+/**
+ *Source address cache.
+ *
+ *A direct mapped table, the readers are lockless under the seqlock and the
+ *misses fill it after the route lookup. The whole table is invalidated by
+ *bumping the generation.
+ */
+#include <linux/seqlock.h>
+#include <linux/jiffies.h>
+#include <linux/hash.h>
+#include <linux/inetdevice.h>
+#include <linux/netdevice.h>
+#include <linux/notifier.h>
+#include <linux/version.h>
+#include "saddr_cache.h"
+
+#define SADDR_CACHE_SHIFT 8
+#define SADDR_CACHE_SIZE (1U << SADDR_CACHE_SHIFT)
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 11, 0)
+#define SADDR_CACHE_RT_GENID(net) rt_genid_ipv4(net)
+#define SADDR_CACHE_TTL (60 * HZ)
+#else
+//No route generation to check, the route changes age out the entries.
+#define SADDR_CACHE_RT_GENID(net) 0
+#define SADDR_CACHE_TTL HZ
+#endif
+
+#define SADDR_CACHE_HASH(key) \
+    hash_32((u32)(key)->daddr ^ (u32)(key)->oif ^ (key)->mark, SADDR_CACHE_SHIFT)
+
+#define SADDR_CACHE_KEY_MATCH(k1, k2)    \
+    ((k1)->net == (k2)->net              \
+     && (k1)->daddr == (k2)->daddr       \
+     && (k1)->oif == (k2)->oif           \
+     && (k1)->mark == (k2)->mark         \
+     && (k1)->tos == (k2)->tos)
+
+struct saddr_cache_entry_t {
+    struct saddr_cache_key_t key;
+    __be32 saddr;
+    unsigned int gen;
+    int rt_genid;
+    unsigned long expires;
+};
+
+static struct saddr_cache_entry_t saddr_cache[SADDR_CACHE_SIZE];
+static DEFINE_SEQLOCK(saddr_cache_lock);
+static atomic_t saddr_cache_gen = ATOMIC_INIT(1); //0 marks the empty entry.
+
+int saddr_cache_lookup(struct saddr_cache_key_t *key, __be32 *saddr)
+{
+    struct saddr_cache_entry_t *e = &saddr_cache[SADDR_CACHE_HASH(key)];
+    unsigned int gen = atomic_read(&saddr_cache_gen);
+    unsigned int seq;
+    int hit;
+
+    do {
+        seq = read_seqbegin(&saddr_cache_lock);
+
+        hit = e->gen == gen
+            && SADDR_CACHE_KEY_MATCH(&e->key, key)
+            && e->rt_genid == SADDR_CACHE_RT_GENID(key->net)
+            && time_before(jiffies, e->expires);
+        if (hit)
+            *saddr = e->saddr;
+
+    } while (read_seqretry(&saddr_cache_lock, seq));
+
+    return hit;
+}
+
+void saddr_cache_update(struct saddr_cache_key_t *key, __be32 saddr)
+{
+    struct saddr_cache_entry_t *e = &saddr_cache[SADDR_CACHE_HASH(key)];
+
+    write_seqlock_bh(&saddr_cache_lock);
+
+    e->key = *key;
+    e->saddr = saddr;
+    e->gen = atomic_read(&saddr_cache_gen);
+    e->rt_genid = SADDR_CACHE_RT_GENID(key->net);
+    e->expires = jiffies + SADDR_CACHE_TTL;
+
+    write_sequnlock_bh(&saddr_cache_lock);
+}
+
+static inline void saddr_cache_flush(void)
+{
+    if (atomic_inc_return(&saddr_cache_gen) == 0) //Skip the empty mark.
+        atomic_inc(&saddr_cache_gen);
+}
+
+static int saddr_cache_event(struct notifier_block *nb, unsigned long event, void *ptr)
+{
+    saddr_cache_flush();
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block saddr_cache_inetaddr_nb = {
+    .notifier_call = saddr_cache_event,
+};
+
+static struct notifier_block saddr_cache_netdev_nb = {
+    .notifier_call = saddr_cache_event,
+};
+
+int saddr_cache_init(void)
+{
+    memset(saddr_cache, 0, sizeof(saddr_cache));
+
+    if (register_inetaddr_notifier(&saddr_cache_inetaddr_nb))
+        return 0;
+
+    if (register_netdevice_notifier(&saddr_cache_netdev_nb)) {
+        unregister_inetaddr_notifier(&saddr_cache_inetaddr_nb);
+        return 0;
+    }
+
+    return 1;
+}
+
+void saddr_cache_destroy(void)
+{
+    unregister_netdevice_notifier(&saddr_cache_netdev_nb);
+    unregister_inetaddr_notifier(&saddr_cache_inetaddr_nb);
+}
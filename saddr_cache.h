@@ -0,0 +1,27 @@
+#ifndef _SADDR_CACHE_H
+#define _SADDR_CACHE_H
+
+#include <linux/types.h>
+#include <net/net_namespace.h>
+
+/**
+ *The route selected source address cache of the unbound clients.
+ *
+ *Keyed by the route inputs (netns, daddr, oif, mark, tos) and invalidated
+ *by the address/device notifications and the route generation id.
+ */
+struct saddr_cache_key_t {
+    struct net *net;
+    __be32 daddr;
+    int oif;
+    u32 mark;
+    u8 tos;
+};
+
+extern int saddr_cache_lookup(struct saddr_cache_key_t *key, __be32 *saddr);
+extern void saddr_cache_update(struct saddr_cache_key_t *key, __be32 saddr);
+
+extern int saddr_cache_init(void);
+extern void saddr_cache_destroy(void);
+
+#endif
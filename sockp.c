@@ -5,6 +5,7 @@
 #include <linux/string.h>
 #include <net/sock.h>
 #include <linux/spinlock.h> 
+#include <linux/completion.h>
 #include "sys_call.h"
 #include "connpd.h"
 #include "sockp.h"
@@ -21,6 +22,7 @@
 
 #define HASH(cliaddr_ptr, servaddr_ptr) ht.hash_table[_hashfn((struct sockaddr_in *)(cliaddr_ptr), (struct sockaddr_in *)(servaddr_ptr))]
 #define SHASH(sk) ht.shash_table[_shashfn(sk)]
+#define IN_USE_COUNT(cliaddr_ptr, servaddr_ptr) ht.in_use_count[_hashfn((struct sockaddr_in *)(cliaddr_ptr), (struct sockaddr_in *)(servaddr_ptr))]
 
 #define KEY_MATCH(address_ptr11, address_ptr12, address_ptr21, address_ptr22) (SOCKADDR_IP(address_ptr11) == SOCKADDR_IP(address_ptr12) && SOCKADDR_PORT(address_ptr21)  == SOCKADDR_PORT(address_ptr22) && SOCKADDR_IP(address_ptr21) == SOCKADDR_IP(address_ptr22))
 #define SKEY_MATCH(sk_ptr1, sk_ptr2) (sk_ptr1 == sk_ptr2)
@@ -123,7 +125,9 @@
         (sb)->sock_create_jiffies = lkm_jiffies; \
         (sb)->last_used_jiffies = lkm_jiffies;    \
         (sb)->connpd_fd = fd; \
+        (sb)->node = numa_node_id(); \
         (sb)->uc = 0; \
+        (sb)->gen++; \
         (sb)->sb_prev = NULL; \
         (sb)->sb_next = NULL; \
         (sb)->sb_sprev = NULL; \
@@ -132,43 +136,19 @@
         (sb)->sb_trav_next = NULL; \
     } while(0)
 
-#define ATOMIC_SET_SOCK_ATTR(sock, attr)                                \
-do {                                                                    \
-    struct socket_bucket *p;                                            \
-                                                                        \
-    SOCKP_LOCK();                                                       \
-                                                                        \
-    if (!sock->sk)                                                      \
-        goto break_unlock;                                              \
-                                                                        \
-    p = SHASH(sock->sk);                                               \
-    for (; p; p = p->sb_snext) {                                        \
-        if (SKEY_MATCH(sock->sk, p->sk)) {                        \
-            p->attr = attr;                                             \
-            break;                                                      \
-        }                                                               \
-    }                                                                   \
-                                                                        \
-break_unlock:                                                           \
-    SOCKP_UNLOCK();                                                     \
-                                                                        \
-} while(0)
-
-#define LEFT_LIFETIME_THRESHOLD ((unsigned)(HZ >> 1)) //500ms
-
 #define SOCK_IS_RECLAIM(sb) ((sb)->sock_create_way == SOCK_RECLAIM)
 #define SOCK_IS_RECLAIM_PASSIVE(sb) (SOCK_IS_RECLAIM(sb) && !cfg_conn_is_positive(&(sb)->servaddr))
 
 #define SOCK_IS_PRECONNECT(sb) ((sb)->sock_create_way == SOCK_PRECONNECT)
-#define SOCK_IS_NOT_SPEC_BUT_PRECONNECT(sb) (!cfg_conn_acl_spec_allowd(&(sb)->servaddr) && SOCK_IS_PRECONNECT(sb))
+#define SOCK_IS_NOT_TARGET_BUT_PRECONNECT(sb) (SOCK_IS_PRECONNECT(sb) && !cfg_conn_preconnect_allowd(&(sb)->servaddr))
 
-#define sockp_sbs_check_list_init(num) \
-    stack_init(&sockp_sbs_check_list, num, sizeof(struct socket_bucket *), WITH_MUTEX)
+#define sockp_sbs_check_list_init(nid, num) \
+    stack_init(&sockp_sbs_check_list(nid), num, sizeof(struct socket_bucket *), WITH_MUTEX)
 
-#define sockp_sbs_check_list_destroy() \
+#define sockp_sbs_check_list_destroy(nid) \
     do {  \
-        if (sockp_sbs_check_list)                    \
-        sockp_sbs_check_list->destroy(&sockp_sbs_check_list);  \
+        if (sockp_sbs_check_list(nid))                    \
+        sockp_sbs_check_list(nid)->destroy(&sockp_sbs_check_list(nid));  \
     } while(0)
 
 #if SOCKP_DEBUG
@@ -206,6 +186,7 @@ static unsigned int loop_count = 0;
 static struct {
     struct socket_bucket *hash_table[NR_HASH];
     struct socket_bucket *shash_table[NR_SHASH]; //for sock addr hash table.
+    unsigned int in_use_count[NR_HASH]; //the socks in use by the hash of the key.
 
     struct socket_bucket *sb_free_p;
 
@@ -219,7 +200,21 @@ static struct {
 
 static struct socket_bucket SB[NR_SOCKET_BUCKET];
 
-struct stack_t *sockp_sbs_check_list;
+/*A blocking connect waiting for a returning sock of the key, served in FIFO order*/
+struct sockp_waiter_t {
+    struct list_head list;
+    struct sockaddr *cliaddr;
+    struct sockaddr *servaddr;
+    u32 fingerprint;
+    struct socket_bucket *sb; /*handed off under the sockp lock*/
+    struct conn_handout_sample_t sample;
+    struct completion ready; /*the sk of the sb is grafted back to the sock of sockp*/
+};
+
+static LIST_HEAD(sockp_waiters); //under the sockp lock
+
+nodemask_t sockp_nodes;
+struct stack_t **sockp_sbs_check_lists;
 
 #if LRU
 static struct socket_bucket *get_empty_slot(struct sockaddr *, struct sockaddr *);
@@ -229,38 +224,208 @@ static struct socket_bucket *get_empty_slot(void);
 
 #define sock_is_not_available(sb) (!sock_is_available(sb))
 static inline int sock_is_available(struct socket_bucket *);
-static inline u64 estimate_min_left_lifetime(u64 est_time);
+static inline s64 sock_idle_left(struct socket_bucket *);
+static inline s64 sock_expire_left(struct socket_bucket *);
+static inline void sock_lifetime_set(struct socket_bucket *);
+static inline void sock_opts_init(struct socket_bucket *);
+static inline void sock_opts_normalize(struct socket_bucket *);
+static inline void sock_keepalive_init(struct socket_bucket *);
+static inline void sock_fingerprint_init(struct socket_bucket *);
+static inline void sock_keepalive_pool(struct socket_bucket *);
+static inline void sock_keepalive_handout(struct socket_bucket *);
+static inline void sock_handout_sample(struct socket_bucket *, struct conn_handout_sample_t *);
 
 static inline unsigned int _hashfn(struct sockaddr_in *, struct sockaddr_in *);
 static inline unsigned int _shashfn(struct sock *);
 
-static inline u64 estimate_min_left_lifetime(u64 timev)
+/**
+ *The jiffies left before the idle sock should be refreshed, the server idle timer
+ *restarts at every use. LLONG_MAX if the server idle timeout is not learned yet.
+ */
+static inline s64 sock_idle_left(struct socket_bucket *sb)
+{
+    u64 sock_keep_alive;
+
+    cfg_conn_get_keep_alive(&sb->servaddr, &sock_keep_alive);
+    if (sock_keep_alive == ULLONG_MAX)
+        return LLONG_MAX;
+
+    return (s64)sock_keep_alive - (s64)lkm_jiffies_elapsed_from(sb->last_used_jiffies);
+}
+
+/**
+ *The jiffies left before the sock reaches its max lifetime, LLONG_MAX if unlimited.
+ */
+static inline s64 sock_expire_left(struct socket_bucket *sb)
 {
-    u64 estimate_time = timev >> 1;
+    if (!sb->lifetime)
+        return LLONG_MAX;
 
-    return MIN(estimate_time, LEFT_LIFETIME_THRESHOLD);
+    return (s64)sb->lifetime - (s64)lkm_jiffies_elapsed_from(sb->sock_create_jiffies);
 }
 
-static inline int sock_is_available(struct socket_bucket *sb)
+/**
+ *Jitter the max lifetime downward, the socks created in a burst expire apart.
+ */
+static inline void sock_lifetime_set(struct socket_bucket *sb)
 {
-    u64 sock_keep_alive;
-    u64 sock_age;
-    s64 sock_left_lifetime;
+    u64 lifetime = 0;
+    u32 jitter;
+
+    cfg_conn_get_max_lifetime(&sb->servaddr, &lifetime);
+    if (!lifetime) {
+        sb->lifetime = 0;
+        return;
+    }
+
+    jitter = (u32)MIN(div_u64(lifetime * CONN_LIFETIME_JITTER_PERCENT, 100), (u64)~0U - 1);
+    if (jitter)
+        lifetime -= lkm_random32() % (jitter + 1);
+
+    sb->lifetime = lifetime ? lifetime : 1;
+}
+
+/**
+ *Learn the options template from the reclaimed sock, apply it to the preconnected one.
+ */
+static inline void sock_opts_init(struct socket_bucket *sb)
+{
+    sb->opts_valid = 0;
+
+    if (SOCK_IS_RECLAIM(sb)) {
+        lkm_sk_sockopts_get(sb->sk, &sb->opts);
+        cfg_conn_learn_sockopts(&sb->servaddr, &sb->opts);
+        sb->opts_valid = 1;
+    } else if (cfg_conn_get_sockopts(&sb->servaddr, &sb->opts)) {
+        lkm_sk_sockopts_set(sb->sk, &sb->opts);
+        sb->opts_valid = 1;
+    }
+}
+
+/**
+ *Normalize the returned sock to the current template of the iport, which may be
+ *learned after the sock joined the pool. Its own snapshot is kept without one.
+ */
+static inline void sock_opts_normalize(struct socket_bucket *sb)
+{
+    if (cfg_conn_get_sockopts(&sb->servaddr, &sb->opts))
+        sb->opts_valid = 1;
+
+    if (sb->opts_valid)
+        lkm_sk_sockopts_set(sb->sk, &sb->opts);
+}
+
+/**
+ *Fingerprint the options after the template applied, must be called with the sockp lock.
+ */
+static inline void sock_fingerprint_init(struct socket_bucket *sb)
+{
+    sb->fingerprint_on = cfg_conn_has_flag(&sb->servaddr, CONN_FINGERPRINT);
+    sb->fingerprint = sb->fingerprint_on ? lkm_sk_fingerprint(sb->sk) : 0;
+}
+
+/**
+ *Load the pool keepalive of the iport and apply it, must be called with the sockp lock.
+ */
+static inline void sock_keepalive_init(struct socket_bucket *sb)
+{
+    memset(&sb->ka_pool, 0, sizeof(sb->ka_pool));
+    sb->ka_pooled = 0;
+
+    cfg_conn_get_keepalive(&sb->servaddr, &sb->ka_pool);
+
+    sock_keepalive_pool(sb);
+}
+
+/**
+ *The idle sock in the pool probes its peer, a dead path errors out and the poller closes it.
+ */
+static inline void sock_keepalive_pool(struct socket_bucket *sb)
+{
+    if (!sb->ka_pool.on || sb->ka_pooled)
+        return;
+
+    lkm_sk_keepalive_get(sb->sk, &sb->ka_saved);
+
+    if (lkm_sk_keepalive_set(sb->sk, &sb->ka_pool))
+        sb->ka_pooled = 1;
+}
+
+/**
+ *Give the user back its own keepalive options.
+ */
+static inline void sock_keepalive_handout(struct socket_bucket *sb)
+{
+    if (!sb->ka_pooled)
+        return;
+
+    if (lkm_sk_keepalive_set(sb->sk, &sb->ka_saved))
+        sb->ka_pooled = 0;
+}
+
+/**
+ *Sample the cwnd before the restart check, the restart is skipped for the keep_cwnd sock.
+ */
+static inline void sock_handout_sample(struct socket_bucket *sb, struct conn_handout_sample_t *sample)
+{
+    sample->cwnd = SK_SND_CWND(sb->sk);
+    sample->srtt_us = SK_SRTT_US(sb->sk);
+    sample->cwnd_kept = sb->keep_cwnd ? lkm_sk_cwnd_keep(sb->sk) : 0;
+}
 
+static inline int sock_is_available(struct socket_bucket *sb)
+{
     if (!SK_ESTABLISHED(sb->sk))
         return 0;
 
-    cfg_conn_get_keep_alive(&sb->servaddr, &sock_keep_alive);
-    sock_age = lkm_jiffies_elapsed_from(sb->sock_create_jiffies);
-    sock_left_lifetime = sock_keep_alive - sock_age;
+    if (sb->sock_in_use)
+        return 1;
 
-    //In case the peer is closing the socket.
-    if (sock_left_lifetime < estimate_min_left_lifetime(sock_keep_alive))
+    if (sock_expire_left(sb) <= 0)
+        return 0;
+
+    //In case the server is closing the idle socket.
+    if (sock_idle_left(sb) <= 0)
         return 0;
 
     return 1;
 }
 
+/**
+ *The cheap checks of the sk before the handout, the sk may be changed between the daemon polls.
+ */
+static inline handout_reject_t sock_handout_check(struct sock *sk)
+{
+    if (!skb_queue_empty(&sk->sk_receive_queue))
+        return HANDOUT_REJECT_RECV_QUEUE;
+
+    if (sk->sk_shutdown & RCV_SHUTDOWN)
+        return HANDOUT_REJECT_RCV_SHUTDOWN;
+
+    if (sk->sk_err)
+        return HANDOUT_REJECT_SK_ERR;
+
+    if (!skb_queue_empty(&sk->sk_write_queue))
+        return HANDOUT_REJECT_WRITE_QUEUE;
+
+    return HANDOUT_VALID;
+}
+
+/**
+ *All the rejects of the handout by a white list lookup, none without a reject.
+ */
+static inline void sock_handout_rejects_flush(struct sockaddr *servaddr, int *rejects)
+{
+    int reason;
+
+    for (reason = HANDOUT_VALID + 1; reason < HANDOUT_REJECT_REASONS; reason++) {
+        if (rejects[reason] > 0) {
+            cfg_conn_add_handout_rejects(servaddr, rejects);
+            break;
+        }
+    }
+}
+
 static inline unsigned int _hashfn(struct sockaddr_in *cliaddr, struct sockaddr_in *servaddr)
 {
     return (unsigned)(SOCKADDR_IP(cliaddr) ^ SOCKADDR_PORT(servaddr) ^ SOCKADDR_IP(servaddr)) % NR_HASH;
@@ -271,17 +436,109 @@ static inline unsigned int _shashfn(struct sock *sk)
     return (unsigned long)sk % NR_SHASH;
 }
 
-SOCK_SET_ATTR_DEFINE(sock, sock_close_now)
+/**
+ *Mark the bucket to close and post it to kconnpd, must be called with the sockp lock.
+ */
+static inline void sb_close_now_post(struct socket_bucket *sb)
 {
-    ATOMIC_SET_SOCK_ATTR(sock, sock_close_now);
+    if (sb->sock_close_now)
+        return;
+
+    sb->sock_close_now = 1;
+    connpd_close_sock_notify(sb);
 }
 
-struct socket_bucket *apply_sk_from_sockp(struct sockaddr *cliaddr, struct sockaddr *servaddr)
+SOCK_SET_ATTR_DEFINE(sock, sock_close_now)
 {
     struct socket_bucket *p;
 
     SOCKP_LOCK();
 
+    if (!sock->sk)
+        goto unlock_ret;
+
+    p = SHASH(sock->sk);
+    for (; p; p = p->sb_snext) {
+        if (SKEY_MATCH(sock->sk, p->sk)) {
+            if (sock_close_now)
+                sb_close_now_post(p);
+            else
+                p->sock_close_now = 0;
+            break;
+        }
+    }
+
+unlock_ret:
+    SOCKP_UNLOCK();
+}
+
+void set_sb_close_now(struct socket_bucket *sb, unsigned int gen)
+{
+    SOCKP_LOCK();
+
+    if (sb->sb_in_use && sb->gen == gen)
+        sb_close_now_post(sb);
+
+    SOCKP_UNLOCK();
+}
+
+/**
+ *Feed the handshake result of the preconnected sock to the breaker, must be called with the sockp lock.
+ */
+static inline void sb_handshake_learn(struct socket_bucket *sb)
+{
+    if (!sb->handshake_pending || SK_ESTABLISHING(sb->sk))
+        return;
+
+    sb->handshake_pending = 0;
+
+    cfg_conn_observe_breaker(&sb->servaddr, 
+            SK_ESTABLISHED(sb->sk) ? CONN_BREAKER_SUCCESS : CONN_BREAKER_FAILURE);
+}
+
+/**
+ *Take the bucket for the handout, must be called with the sockp lock.
+ */
+static inline void sb_handout_take(struct socket_bucket *p, struct conn_handout_sample_t *sample)
+{
+    sb_handshake_learn(p);
+
+    if(++p->uc > MAX_REQUESTS)  //check used count
+        p->sock_close_now = 1;
+
+    p->sock_in_use = 1; //set "in use" tag.
+    IN_USE_COUNT(&p->cliaddr, &p->servaddr)++;
+
+    sock_keepalive_handout(p);
+
+    sock_handout_sample(p, sample);
+}
+
+/**
+ *Finish the handout out of the sockp lock, the sk is grafted to the user sock by the caller.
+ */
+static inline void sb_handout_done(struct socket_bucket *p, struct sockaddr *servaddr, 
+        struct conn_handout_sample_t *sample)
+{
+    //Remove reference to avoid to destroy the sk in sockp.
+    spin_lock(&p->s_lock);
+    p->sock->sk = NULL;
+    spin_unlock(&p->s_lock);
+
+    cfg_conn_observe_handout(servaddr, sample);
+
+    connpd_work_notify(CONNPD_WORK_PRECONNECT);
+}
+
+/**
+ *Find a idle sock of the key and take it, must be called with the sockp lock.
+ */
+static struct socket_bucket *sb_handout_find(struct sockaddr *cliaddr, struct sockaddr *servaddr, 
+        u32 fingerprint, int *rejects, struct conn_handout_sample_t *sample)
+{
+    struct socket_bucket *p;
+    handout_reject_t reason;
+
     p = HASH(cliaddr, servaddr);
     for (; p; p = p->sb_next) {
 
@@ -290,6 +547,7 @@ struct socket_bucket *apply_sk_from_sockp(struct sockaddr *cliaddr, struct socka
         if (KEY_MATCH(cliaddr, &p->cliaddr, servaddr, &p->servaddr)) {
 
             if (p->sock_in_use 
+                    || p->fingerprint != fingerprint
                     || p->sock_close_now
                     || !p->sock->sk
                     || sock_is_not_available(p) 
@@ -300,39 +558,199 @@ struct socket_bucket *apply_sk_from_sockp(struct sockaddr *cliaddr, struct socka
                 printk(KERN_ERR "SK of sock changed!");
                 continue;
             }
-                
-            if(++p->uc > MAX_REQUESTS)  //check used count
-                p->sock_close_now = 1;
 
-            p->sock_in_use = 1; //set "in use" tag.
+            if ((reason = sock_handout_check(p->sk)) != HANDOUT_VALID) {
+                sb_close_now_post(p); //queue it for close.
+                rejects[reason]++;
+                continue;
+            }
 
             REMOVE_FROM_HLIST(HASH(cliaddr, servaddr), p);
 
+            sb_handout_take(p, sample);
+
             LOOP_COUNT_RESET();
-           
-            SOCKP_UNLOCK();
-            
-            //Remove reference to avoid to destroy the sk in sockp.
-            spin_lock(&p->s_lock);
-            p->sock->sk = NULL;
-            spin_unlock(&p->s_lock);
-            
+
             return p;
         }
     }
 
     LOOP_COUNT_RESET();
 
+    return NULL;
+}
+
+struct socket_bucket *apply_sk_from_sockp(struct sockaddr *cliaddr, struct sockaddr *servaddr, u32 fingerprint)
+{
+    struct socket_bucket *p;
+    int rejects[HANDOUT_REJECT_REASONS] = {0, };
+    struct conn_handout_sample_t sample;
+
+    SOCKP_LOCK();
+
+    p = sb_handout_find(cliaddr, servaddr, fingerprint, rejects, &sample);
+
     SOCKP_UNLOCK();
+
+    if (p)
+        sb_handout_done(p, servaddr, &sample);
+
+    sock_handout_rejects_flush(servaddr, rejects);
+
+    return p;
+}
+
+/**
+ *Wether a sock of the key may be in use, its return may serve a waiter. The socks of
+ *the other keys of the same hash are counted too, such a waiter only waits its timeout out.
+ *Must be called with the sockp lock.
+ */
+static inline int sb_key_in_use(struct sockaddr *cliaddr, struct sockaddr *servaddr)
+{
+    return IN_USE_COUNT(cliaddr, servaddr) > 0;
+}
+
+/**
+ *Hand the returned sock to the first waiter of its key, must be called with the sockp lock.
+ */
+static inline struct sockp_waiter_t *sb_waiter_handoff(struct socket_bucket *sb)
+{
+    struct sockp_waiter_t *w;
+
+    if (list_empty(&sockp_waiters) 
+            || sb->sock_close_now
+            || SOCK_IS_RECLAIM_PASSIVE(sb)
+            || sock_handout_check(sb->sk) != HANDOUT_VALID)
+        return NULL;
+
+    list_for_each_entry(w, &sockp_waiters, list) {
+
+        if (w->fingerprint == sb->fingerprint
+                && KEY_MATCH(w->cliaddr, &sb->cliaddr, w->servaddr, &sb->servaddr)) {
+
+            list_del_init(&w->list);
+
+            sb_handout_take(sb, &w->sample);
+            w->sb = sb;
+
+            return w;
+        }
+    }
+
     return NULL;
 }
 
+/**
+ *Wake the waiter after the sk grafted back to the sock of sockp.
+ */
+static inline void sb_waiter_wake(struct sockp_waiter_t *w)
+{
+    complete(&w->ready);
+}
+
+struct socket_bucket *wait_sk_from_sockp(struct sockaddr *cliaddr, struct sockaddr *servaddr, 
+        u32 fingerprint, long timeout)
+{
+    struct sockp_waiter_t w;
+    struct socket_bucket *p;
+    int rejects[HANDOUT_REJECT_REASONS] = {0, };
+    struct conn_queue_sample_t qs;
+    u64 start_jiffies = lkm_jiffies;
+
+    memset(&w, 0, sizeof(w));
+    INIT_LIST_HEAD(&w.list);
+    w.cliaddr = cliaddr;
+    w.servaddr = servaddr;
+    w.fingerprint = fingerprint;
+    init_completion(&w.ready);
+
+    SOCKP_LOCK();
+
+    //A sock may be returned after the miss, or nothing is to be returned.
+    p = sb_handout_find(cliaddr, servaddr, fingerprint, rejects, &w.sample);
+    if (!p && sb_key_in_use(cliaddr, servaddr))
+        list_add_tail(&w.list, &sockp_waiters);
+
+    SOCKP_UNLOCK();
+
+    sock_handout_rejects_flush(servaddr, rejects);
+
+    if (p) {
+        sb_handout_done(p, servaddr, &w.sample);
+        return p;
+    }
+
+    if (list_empty(&w.list))
+        return NULL;
+
+    qs.event = CONN_QUEUE_ENTER;
+    qs.wait_us = 0;
+    cfg_conn_observe_queue(servaddr, &qs);
+
+    if (timeout <= 0 || wait_for_completion_interruptible_timeout(&w.ready, timeout) <= 0) {
+        SOCKP_LOCK();
+        if (!w.sb)
+            list_del(&w.list);
+        SOCKP_UNLOCK();
+
+        if (w.sb) //handed off just now, wait for the graft.
+            wait_for_completion(&w.ready);
+    }
+
+    qs.event = w.sb ? CONN_QUEUE_SERVED : CONN_QUEUE_TIMEOUT;
+    qs.wait_us = jiffies_to_usecs(lkm_jiffies_elapsed_from(start_jiffies));
+    cfg_conn_observe_queue(servaddr, &qs);
+
+    if (w.sb)
+        sb_handout_done(w.sb, servaddr, &w.sample);
+
+    return w.sb;
+}
+
+/**
+ *Learn the server idle timeout from the sock closed by the peer, must be called with the sockp lock.
+ */
+static inline void sb_close_now_learn(struct socket_bucket *sb)
+{
+    if (!sb->sock_in_use && SK_PEER_CLOSED(sb->sk)) { //closed by the server idle timer.
+        u64 idle;
+        idle = lkm_jiffies_elapsed_from(sb->last_used_jiffies);
+        cfg_conn_add_idle_close(&sb->servaddr, &idle);
+    }
+
+    if (!sb->sock_in_use && sb->sk->sk_err == ECONNRESET) //reset by the server.
+        cfg_conn_observe_breaker(&sb->servaddr, CONN_BREAKER_FAILURE);
+}
+
+/**
+ *Queue the fd to close and put the bucket, must be called with the sockp lock.
+ */
+static inline int sb_shutdown(struct socket_bucket *sb)
+{
+    if (connpd_close_pending_fds_in(sb->connpd_fd) < 0) {
+        printk(KERN_ERR "Close pending fds buffer overflow!");
+        return 0;
+    }
+
+    if (IN_HLIST(HASH(&sb->cliaddr, &sb->servaddr), sb))
+        REMOVE_FROM_HLIST(HASH(&sb->cliaddr, &sb->servaddr), sb);
+    if (sb->sock_in_use) //never returned.
+        IN_USE_COUNT(&sb->cliaddr, &sb->servaddr)--;
+    REMOVE_FROM_SHLIST(SHASH(sb->sk), sb);
+    REMOVE_FROM_TLIST(sb);
+
+    PUT_SB(sb);
+
+    return 1;
+}
+
 /**
  *To scan all sock pool to close the expired or all sockets. The caller is kconnpd.
  */
-void shutdown_sock_list(shutdown_way_t shutdown_way)
+long shutdown_sock_list(shutdown_way_t shutdown_way)
 {
     struct socket_bucket *p; 
+    long next_timeout = MAX_SCHEDULE_TIMEOUT;
 
     BUG_ON(!INVOKED_BY_CONNP_DAEMON());
 
@@ -346,20 +764,17 @@ void shutdown_sock_list(shutdown_way_t shutdown_way)
         if (shutdown_way == SHUTDOWN_ALL)
             goto shutdown;
 
+        sb_handshake_learn(p);
+
         if (p->sock_close_now) {
-           if (!p->uc) { //get keep alive timeout at begin time.
-               u64 keep_alive;
-               keep_alive = lkm_jiffies_elapsed_from(p->sock_create_jiffies);
-               cfg_conn_set_keep_alive(&p->servaddr, &keep_alive);
-           }
-           cfg_conn_set_passive(&p->servaddr); //may be passive socket 
+           sb_close_now_learn(p);
            goto shutdown;
         }
 
         if (!SK_ESTABLISHING(p->sk) && sock_is_not_available(p))
             goto shutdown;
 
-        if (SOCK_IS_NOT_SPEC_BUT_PRECONNECT(p)
+        if (SOCK_IS_NOT_TARGET_BUT_PRECONNECT(p)
                 || SOCK_IS_RECLAIM_PASSIVE(p) 
                 || (SOCK_IS_RECLAIM(p)
                     && (lkm_jiffies_elapsed_from(p->last_used_jiffies) > WAIT_TIMEOUT))
@@ -372,33 +787,46 @@ void shutdown_sock_list(shutdown_way_t shutdown_way)
         if (conn_spec_check_close_flag(&p->servaddr))
             goto shutdown;
 
-        if (!p->sock_in_use)
+        //The expiring one is replaced by the preconnect before it is closed.
+        if (!p->sock_in_use && sock_expire_left(p) > CONN_LIFETIME_WARMUP)
             conn_inc_idle_count(&p->servaddr);
 
         conn_inc_all_count(&p->servaddr);
 
-        sockp_sbs_check_list_in(&p);
+        if (SOCK_IS_RECLAIM(p) || (SOCK_IS_PRECONNECT(p) && p->sock_in_use)) {
+            long left = WAIT_TIMEOUT - lkm_jiffies_elapsed_from(p->last_used_jiffies) + 1;
+            if (left < next_timeout)
+                next_timeout = left > 0 ? left : 0;
+        }
+
+        if (!p->sock_in_use) { //refresh it before the server idle timeout or the expiry.
+            s64 left = sock_idle_left(p);
+            s64 expire_left = sock_expire_left(p);
+
+            if (expire_left > CONN_LIFETIME_WARMUP)
+                expire_left -= CONN_LIFETIME_WARMUP;
+            left = MIN(left, expire_left) + 1;
+
+            if (left < next_timeout)
+                next_timeout = left > 0 ? left : 0;
+        }
+
+        sockp_sbs_check_list_in(SOCKP_NODE(p->node), &p);
 
         continue;
 
 shutdown:
+        //Evicted by the pool, the ones closed by the server are the passives.
+        if (shutdown_way != SHUTDOWN_ALL && !p->sock_in_use && !p->sock_close_now)
+            cfg_conn_inc_hot_stat(&p->servaddr, CONN_HOT_EVICTIONS);
+
         do {
             LOOP_COUNT_LOCAL_DEFINE(local_loop_count);
             LOOP_COUNT_SAVE(local_loop_count);
 
             LOOP_COUNT_RESET();
 
-            if (connpd_close_pending_fds_in(p->connpd_fd) < 0) {
-                printk(KERN_ERR "Close pending fds buffer overflow!");
-                break;
-            }
-
-            if (IN_HLIST(HASH(&p->cliaddr, &p->servaddr), p))
-                REMOVE_FROM_HLIST(HASH(&p->cliaddr, &p->servaddr), p);
-            REMOVE_FROM_SHLIST(SHASH(p->sk), p);
-            REMOVE_FROM_TLIST(p);
-
-            PUT_SB(p);
+            sb_shutdown(p);
 
             LOOP_COUNT_RESTORE(local_loop_count);
         } while (0);
@@ -407,6 +835,72 @@ shutdown:
     LOOP_COUNT_RESET();
     
     SOCKP_UNLOCK();
+
+    return next_timeout;
+}
+
+/**
+ *Shutdown the bucket posted to close without the scan. The caller is kconnpd.
+ */
+int shutdown_sock(struct socket_bucket *sb, unsigned int gen)
+{
+    int closed = 0;
+
+    BUG_ON(!INVOKED_BY_CONNP_DAEMON());
+
+    SOCKP_LOCK();
+
+    if (sb->sb_in_use && sb->gen == gen && sb->sock_close_now) {
+        sb_handshake_learn(sb);
+        sb_close_now_learn(sb);
+        closed = sb_shutdown(sb);
+    }
+
+    LOOP_COUNT_RESET();
+
+    SOCKP_UNLOCK();
+
+    return closed;
+}
+
+/**
+ *Queue the bucket posted to poll without the scan. The caller is kconnpd.
+ */
+long check_sock_in(struct socket_bucket *sb, unsigned int gen)
+{
+    long timeout = -1;
+
+    BUG_ON(!INVOKED_BY_CONNP_DAEMON());
+
+    SOCKP_LOCK();
+
+    if (!sb->sb_in_use || sb->gen != gen || sb->sock_close_now)
+        goto unlock_ret;
+
+    if (!sockp_sbs_check_list_in(SOCKP_NODE(sb->node), &sb))
+        goto unlock_ret;
+
+    timeout = MAX_SCHEDULE_TIMEOUT;
+
+    if (SOCK_IS_RECLAIM(sb))
+        timeout = WAIT_TIMEOUT + 1;
+
+    if (!sb->sock_in_use) {
+        s64 left = sock_idle_left(sb);
+        s64 expire_left = sock_expire_left(sb);
+
+        if (expire_left > CONN_LIFETIME_WARMUP)
+            expire_left -= CONN_LIFETIME_WARMUP;
+        left = MIN(left, expire_left) + 1;
+
+        if (left < timeout)
+            timeout = left > 0 ? left : 0;
+    }
+
+unlock_ret:
+    SOCKP_UNLOCK();
+
+    return timeout;
 }
 
 /**
@@ -415,6 +909,7 @@ shutdown:
 struct socket_bucket *free_sk_to_sockp(struct sock *sk)
 {
     struct socket_bucket *p, *sb = NULL;
+    struct sockp_waiter_t *w = NULL;
 
     SOCKP_LOCK();
 
@@ -431,9 +926,20 @@ struct socket_bucket *free_sk_to_sockp(struct sock *sk)
             }
 
             p->sock_in_use = 0; //clear "in use" tag.
+            IN_USE_COUNT(&p->cliaddr, &p->servaddr)--;
             p->last_used_jiffies = lkm_jiffies;
 
-            INSERT_INTO_HLIST(HASH(&p->cliaddr, &p->servaddr), p);
+            if (sock_expire_left(p) <= 0) //max lifetime reached, close it.
+                sb_close_now_post(p);
+            else {
+                sock_opts_normalize(p); //undo the options set by the last user.
+                if (p->fingerprint_on) //the last user may set the other options.
+                    p->fingerprint = lkm_sk_fingerprint(p->sk);
+                if (!(w = sb_waiter_handoff(p))) {
+                    sock_keepalive_pool(p);
+                    INSERT_INTO_HLIST(HASH(&p->cliaddr, &p->servaddr), p);
+                }
+            }
 
             sb = p;
             
@@ -450,9 +956,78 @@ struct socket_bucket *free_sk_to_sockp(struct sock *sk)
     if (sb)
         sock_graft(sk, sb->sock);
 
+    if (w)
+        sb_waiter_wake(w);
+
     return sb;
 }
 
+int free_sks_to_sockp(struct sockp_batch_ent_t *ents, int n)
+{
+    struct socket_bucket *p;
+    int i, count = 0;
+
+    SOCKP_LOCK();
+
+    for (i = 0; i < n; i++) {
+        struct sock *sk = ents[i].sock->sk;
+
+        ents[i].sb = NULL;
+        ents[i].waiter = NULL;
+
+        p = SHASH(sk);
+        for (; p; p = p->sb_snext) {
+
+            LOOP_COUNT_SAFE_CHECK(p);
+
+            if (SKEY_MATCH(sk, p->sk)) {
+
+                if (!p->sock_in_use) {//can't release it repeatedly!
+                    printk(KERN_ERR "Free socket error!");
+                    break;
+                }
+
+                p->sock_in_use = 0; //clear "in use" tag.
+                IN_USE_COUNT(&p->cliaddr, &p->servaddr)--;
+                p->last_used_jiffies = lkm_jiffies;
+
+                if (sock_expire_left(p) <= 0) //max lifetime reached, close it.
+                    sb_close_now_post(p);
+                else {
+                    sock_opts_normalize(p); //undo the options set by the last user.
+                    if (p->fingerprint_on) //the last user may set the other options.
+                        p->fingerprint = lkm_sk_fingerprint(p->sk);
+                    if (!(ents[i].waiter = sb_waiter_handoff(p))) {
+                        sock_keepalive_pool(p);
+                        INSERT_INTO_HLIST(HASH(&p->cliaddr, &p->servaddr), p);
+                    }
+                }
+
+                ents[i].sb = p;
+                count++;
+
+                break;
+            }
+
+        }
+
+        LOOP_COUNT_RESET();
+    }
+
+    SOCKP_UNLOCK();
+
+    //Grafted to sock of sockp
+    for (i = 0; i < n; i++) {
+        if (ents[i].sb)
+            sock_graft(ents[i].sock->sk, ents[i].sb->sock);
+
+        if (ents[i].waiter)
+            sb_waiter_wake(ents[i].waiter);
+    }
+
+    return count;
+}
+
 static inline int socket_buckets_pool_resize(void)
 {
     static int nr_current_connections = 0;
@@ -587,16 +1162,105 @@ struct socket_bucket *insert_sock_to_sockp(struct sockaddr *cliaddr,
     SOCKADDR_COPY(&sb->cliaddr, cliaddr);
     SOCKADDR_COPY(&sb->servaddr, servaddr);
 
+    sock_lifetime_set(sb);
+    sock_opts_init(sb);
+    sock_fingerprint_init(sb);
+    sb->handshake_pending = SOCK_IS_PRECONNECT(sb);
+    sock_keepalive_init(sb);
+    sb->keep_cwnd = cfg_conn_has_flag(&sb->servaddr, CONN_KEEP_CWND);
+
     INSERT_INTO_HLIST(HASH(&sb->cliaddr, &sb->servaddr), sb);
     INSERT_INTO_SHLIST(SHASH(sb->sk), sb);
     INSERT_INTO_TLIST(sb);
 
+    connpd_poll_sock_notify(sb); //poll the new sock.
+
 unlock_ret:
     SOCKP_UNLOCK();
 
     return sb;
 }
 
+int insert_socks_to_sockp(struct sockp_batch_ent_t *ents, int n)
+{
+    struct socket_bucket *sb;
+    int i, count = 0;
+
+    SOCKP_LOCK();
+
+    for (i = 0; i < n; i++) {
+        if (ents[i].sb || ents[i].connpd_fd < 0)
+            continue;
+
+#if LRU
+        if (!(sb = get_empty_slot(&ents[i].cliaddr, &ents[i].servaddr))) 
+            break;
+#else
+        if (!(sb = get_empty_slot())) 
+            break;
+#endif
+
+        INIT_SB(sb, ents[i].sock, ents[i].connpd_fd, SOCK_RECLAIM);
+
+        SOCKADDR_COPY(&sb->cliaddr, &ents[i].cliaddr);
+        SOCKADDR_COPY(&sb->servaddr, &ents[i].servaddr);
+
+        sock_lifetime_set(sb);
+        sock_opts_init(sb);
+        sock_fingerprint_init(sb);
+        sb->handshake_pending = 0; //reclaimed
+        sock_keepalive_init(sb);
+        sb->keep_cwnd = cfg_conn_has_flag(&sb->servaddr, CONN_KEEP_CWND);
+
+        INSERT_INTO_HLIST(HASH(&sb->cliaddr, &sb->servaddr), sb);
+        INSERT_INTO_SHLIST(SHASH(sb->sk), sb);
+        INSERT_INTO_TLIST(sb);
+
+        connpd_poll_sock_notify(sb); //poll the new sock.
+
+        ents[i].sb = sb;
+        count++;
+    }
+
+    SOCKP_UNLOCK();
+
+    return count;
+}
+
+static void sockp_sbs_check_lists_destroy(void)
+{
+    int nid;
+
+    if (!sockp_sbs_check_lists)
+        return;
+
+    for_each_node_mask(nid, sockp_nodes)
+        sockp_sbs_check_list_destroy(nid);
+
+    lkmfree(sockp_sbs_check_lists);
+    sockp_sbs_check_lists = NULL;
+}
+
+static int sockp_sbs_check_lists_init(int num)
+{
+    int nid;
+
+    sockp_nodes = node_online_map;
+
+    sockp_sbs_check_lists = lkmalloc(MAX_NUMNODES * sizeof(struct stack_t *));
+    if (!sockp_sbs_check_lists)
+        return 0;
+
+    for_each_node_mask(nid, sockp_nodes) {
+        if (!sockp_sbs_check_list_init(nid, num)) {
+            sockp_sbs_check_lists_destroy();
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
 int sockp_init()
 {
     struct socket_bucket *sb_tmp;
@@ -622,7 +1286,7 @@ int sockp_init()
 
     SOCKP_LOCK_INIT();
     
-    if (!sockp_sbs_check_list_init(NR_SOCKET_BUCKET))
+    if (!sockp_sbs_check_lists_init(NR_SOCKET_BUCKET))
         return 0;
 
     return 1;
@@ -633,6 +1297,6 @@ int sockp_init()
  */
 void sockp_destroy(void)
 {
-    sockp_sbs_check_list_destroy();
+    sockp_sbs_check_lists_destroy();
     SOCKP_LOCK_DESTROY();
 }
@@ -9,6 +9,8 @@
 #include <linux/in.h> /*define struct sockaddr_in*/
 #include <linux/net.h> /*define struct socket*/
 #include <net/tcp_states.h>
+#include <linux/nodemask.h>
+#include "lkm_util.h"
 #include "stack.h"
 
 #define SOCKP_DEBUG 0
@@ -40,6 +42,15 @@ typedef enum {
     SHUTDOWN_IDLE
 } shutdown_way_t;
 
+typedef enum {
+    HANDOUT_VALID = 0,
+    HANDOUT_REJECT_RECV_QUEUE, /*stray unread bytes*/
+    HANDOUT_REJECT_RCV_SHUTDOWN, /*FIN queued*/
+    HANDOUT_REJECT_SK_ERR, /*late RST or error*/
+    HANDOUT_REJECT_WRITE_QUEUE, /*unsent or unacked data*/
+    HANDOUT_REJECT_REASONS
+} handout_reject_t;
+
 struct socket_bucket {
     struct sockaddr cliaddr;
     struct sockaddr servaddr;
@@ -59,6 +70,22 @@ struct socket_bucket {
 
     u64 uc; /*used count*/
 
+    u64 lifetime; /*jiffies from the create to the expiry with jitter, 0: unlimited*/
+
+    struct lkm_keepalive_t ka_pool; /*the keepalive while in the pool, off if not configured*/
+    struct lkm_keepalive_t ka_saved; /*the keepalive of the user, restored at handout*/
+    unsigned char ka_pooled; /*tag: wether ka_pool is applied*/
+
+    unsigned char keep_cwnd; /*tag: no slow start restart at the handout*/
+
+    struct lkm_sockopts_t opts; /*the last template of the iport applied, normalized to at the return*/
+    unsigned char opts_valid;
+
+    u32 fingerprint; /*part of the pool key, 0: the default options*/
+    unsigned char fingerprint_on; /*tag: the iport matches the fingerprint*/
+
+    unsigned char handshake_pending; /*tag: the preconnect result is not fed to the breaker yet*/
+
     struct socket_bucket *sb_prev;
     struct socket_bucket *sb_next; /*for hash table*/
 
@@ -73,26 +100,51 @@ struct socket_bucket {
 
     int connpd_fd; /*attached fd of the connpd*/
 
+    int node; /*numa node where the sock created or reclaimed*/
+
+    unsigned int gen; /*bumped at every init, tags the work items of the bucket*/
+
     spinlock_t s_lock; //sb spin lock
 };
 
-extern struct stack_t *sockp_sbs_check_list;
+/*The numa nodes of the pool shards, every shard is polled by its own connpd thread*/
+extern nodemask_t sockp_nodes;
 
-#define sockp_sbs_check_list_in(sb) \
-    sockp_sbs_check_list->in(sockp_sbs_check_list, sb)
+#define SOCKP_NODE(nid) \
+    (((nid) >= 0 && (nid) < MAX_NUMNODES && node_isset(nid, sockp_nodes)) \
+     ? (nid) : first_node(sockp_nodes))
 
-#define sockp_sbs_check_list_out(sb) \
-    sockp_sbs_check_list->out(sockp_sbs_check_list)
+extern struct stack_t **sockp_sbs_check_lists; /*per numa node*/
+
+#define sockp_sbs_check_list(nid) sockp_sbs_check_lists[nid]
+
+#define sockp_sbs_check_list_in(nid, sb) \
+    sockp_sbs_check_list(nid)->in(sockp_sbs_check_list(nid), sb)
+
+#define sockp_sbs_check_list_out(nid) \
+    sockp_sbs_check_list(nid)->out(sockp_sbs_check_list(nid))
 
 #define SOCK_SET_ATTR_DEFINE(sock, attr) \
     void set_##attr(struct socket *sock, typeof(((struct socket_bucket *)NULL)->attr) attr)
 
 extern void set_sock_close_now(struct socket *sock, typeof(((struct socket_bucket *)NULL)->sock_close_now) close_now);
 
+/**
+ *Mark the bucket of the generation to close and queue it to kconnpd.
+ */
+extern void set_sb_close_now(struct socket_bucket *sb, unsigned int gen);
+
 /**
  *Apply a existed socket from socket pool.
  */
-extern struct socket_bucket *apply_sk_from_sockp(struct sockaddr *, struct sockaddr *);
+extern struct socket_bucket *apply_sk_from_sockp(struct sockaddr *, struct sockaddr *, u32 fingerprint);
+
+/**
+ *Wait up to the timeout for a sock of the key returned to sockp, the waiters are served in FIFO order.
+ *NULL at once if no sock of the key is in use.
+ */
+extern struct socket_bucket *wait_sk_from_sockp(struct sockaddr *, struct sockaddr *, 
+        u32 fingerprint, long timeout);
 
 /**
  *Free a socket which is returned by 'apply_socket_from_sockp', return the bucket of this socket.
@@ -105,7 +157,44 @@ extern struct socket_bucket *free_sk_to_sockp(struct sock *);
 extern struct socket_bucket *insert_sock_to_sockp(struct sockaddr *, struct sockaddr *, 
         struct socket *, int fd, sock_create_way_t create_way);
 
-extern void shutdown_sock_list(shutdown_way_t shutdown_way);
+#define SOCKP_BATCH_SIZE 16
+
+struct sockp_waiter_t;
+
+struct sockp_batch_ent_t {
+    struct sockaddr cliaddr;
+    struct sockaddr servaddr;
+    struct socket *sock;
+    int connpd_fd;
+    struct socket_bucket *sb; /*the bucket freed or inserted*/
+    struct sockp_waiter_t *waiter; /*the waiter the freed bucket is handed off to*/
+};
+
+/**
+ *Batched 'free_sk_to_sockp' under one lock, the sb of the freed entry is set.
+ */
+extern int free_sks_to_sockp(struct sockp_batch_ent_t *ents, int n);
+
+/**
+ *Batched 'insert_sock_to_sockp' of the entries with the connpd fd and without the sb.
+ */
+extern int insert_socks_to_sockp(struct sockp_batch_ent_t *ents, int n);
+
+/**
+ *Returns the jiffies to the nearest idle timeout of the left socks, MAX_SCHEDULE_TIMEOUT if none.
+ */
+extern long shutdown_sock_list(shutdown_way_t shutdown_way);
+
+/**
+ *Shutdown the bucket of the generation marked to close, the caller is kconnpd.
+ */
+extern int shutdown_sock(struct socket_bucket *sb, unsigned int gen);
+
+/**
+ *Queue the new bucket of the generation to the check list of its node, the caller is kconnpd.
+ *Returns the jiffies to its idle timeout, -1 if it is not queued.
+ */
+extern long check_sock_in(struct socket_bucket *sb, unsigned int gen);
 
 extern int sockp_init(void);
 extern void sockp_destroy(void);
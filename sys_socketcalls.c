@@ -3,6 +3,7 @@
 #include <linux/file.h>
 #include <linux/version.h>
 #include "sockp.h"
+#include "cfg.h"
 #include "connp.h"
 #include "sys_call.h"
 #include "lkm_util.h"
@@ -21,6 +22,25 @@ static inline int connp_move_addr_to_kernel(void __user *uaddr, int ulen, struct
     return 0;
 }
 
+/**
+ *Check the destination by the prefilter before copying the whole address.
+ */
+static inline int connp_prefilter_user_addr(void __user *uaddr, int ulen)
+{
+    struct sockaddr_in sin;
+
+    if (ulen < (int)sizeof(struct sockaddr_in))
+        return 0;
+
+    if (copy_from_user(&sin, uaddr, offsetof(struct sockaddr_in, sin_zero)))
+        return 0;
+
+    if (sin.sin_family != AF_INET)
+        return 0;
+
+    return cfg_conn_prefilter(&sin);
+}
+
 #ifdef __NR_socketcall /*32 bits*/
 asmlinkage long connp_sys_socketcall(int call, unsigned long __user *args)
 {
@@ -57,19 +77,28 @@ asmlinkage long connp_sys_connect(int fd,
 {
     struct sockaddr_storage servaddr;
     int err;
+
+    if (!connp_prefilter_user_addr(uservaddr, addrlen))
+        return orig_sys_connect(fd, uservaddr, addrlen);
     
     err = connp_move_addr_to_kernel(uservaddr, addrlen, (struct sockaddr *)&servaddr);
     if (err < 0)
         return -EFAULT;
     
     if ((err = fetch_conn_from_connp(fd, (struct sockaddr *)&servaddr))) {
-        if (err == CONN_BLOCK)
+        if (err < 0) //over the active ceiling or the breaker open.
+            return err;
+        else if (err == CONN_BLOCK)
             return 0;
         else if (err == CONN_NONBLOCK)
             return -EINPROGRESS;
     }
 
-    return orig_sys_connect(fd, uservaddr, addrlen);
+    err = orig_sys_connect(fd, uservaddr, addrlen);
+    if (err != -EINPROGRESS && err != -EALREADY && err != -EINTR && err != -EISCONN)
+        connp_connect_result(fd, (struct sockaddr *)&servaddr, err);
+
+    return err;
 }
 
 asmlinkage long connp_sys_shutdown(int fd, int way)